@@ -0,0 +1,298 @@
+/* Description:
+ *
+ * Benchmark driver for smallsh. Starts the shell on a pair of pipes and
+ * feeds it generated command lines one at a time, timing each from the
+ * write() of the line until the shell has run it, so what's measured is
+ * the whole read -> parse -> launch -> wait round trip.
+ *
+ * Every line is followed by a built-in `echo @@` so there is something
+ * to wait for even when the command prints nothing (or runs in the bgr).
+ *
+ * WORKLOADS:
+ *    fg        N trivial foreground commands (/bin/true)
+ *    bg        N background jobs (/bin/true &)
+ *    redirect  N commands with < and > files (/bin/cat < in > out)
+ *    longargs  N commands with a long argument list (/bin/true a0 .. a499)
+ *    loop      N for loops of LOOP_ITEMS passes, each running the built-in
+ *              true with LOOP_ARGS $i args
+ *
+ * For each one it reports commands/sec, p50 & p99 latency, and the
+ * shell's peak RSS (VmHWM) measured just before it is told to exit.
+ *
+ * The loop workload is also a check that a loop runs in bounded memory:
+ * if the shell's VmSize after the last line is more than LOOP_SLACK kB
+ * over what it was after the first, it says so and bench exits 1.
+ *
+ * Usage:
+ *    bench [-n N] [-w workload] [path to smallsh]
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#define MARKER "@@\n"
+#define LONG_ARGS 500
+#define LOOP_ITEMS 100
+#define LOOP_ARGS 1000
+#define LOOP_SLACK 1024 // kB
+
+struct shell {
+   pid_t pid;
+   int to; // write end of the shell's stdin
+   int from; // read end of the shell's stdout
+   char buf[65536]; // what's been read from it and not looked at yet
+   size_t len;
+};
+
+static double now(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void shell_start(struct shell *sh, const char *path) {
+   int in[2], out[2];
+   if (pipe(in) == -1 || pipe(out) == -1) {
+      perror("pipe");
+      exit(1);
+   }
+   sh->pid = fork();
+   if (sh->pid == -1) {
+      perror("fork");
+      exit(1);
+   }
+   if (sh->pid == 0) { // in child...
+      dup2(in[0], 0);
+      dup2(out[1], 1);
+      close(in[0]);
+      close(in[1]);
+      close(out[0]);
+      close(out[1]);
+      execl(path, path, (char *)NULL);
+      perror(path);
+      _exit(1);
+   }
+   close(in[0]);
+   close(out[1]);
+   sh->to = in[1];
+   sh->from = out[0];
+   sh->len = 0;
+}
+
+// send a line, and read until the shell has echoed the marker back
+void shell_run(struct shell *sh, const char *line, size_t len) {
+   size_t off = 0;
+   while (off < len) {
+      ssize_t n = write(sh->to, line + off, len - off);
+      if (n == -1 && errno != EINTR) {
+         perror("write");
+         exit(1);
+      }
+      off += n > 0 ? n : 0;
+   }
+   for (;;) {
+      // the marker is always a line of its own; drop everything up to it
+      char *nl = memchr(sh->buf, '\n', sh->len);
+      while (nl != NULL) {
+         size_t line_len = nl - sh->buf + 1;
+         int done = line_len == strlen(MARKER) && memcmp(sh->buf, MARKER, line_len) == 0;
+         memmove(sh->buf, nl + 1, sh->len - line_len);
+         sh->len -= line_len;
+         if (done) {
+            return;
+         }
+         nl = memchr(sh->buf, '\n', sh->len);
+      }
+      if (sh->len == sizeof(sh->buf)) { // a huge line, nothing to keep
+         sh->len = 0;
+      }
+      ssize_t n = read(sh->from, sh->buf + sh->len, sizeof(sh->buf) - sh->len);
+      if (n == 0) {
+         fprintf(stderr, "bench: the shell exited early\n");
+         exit(1);
+      }
+      if (n == -1 && errno != EINTR) {
+         perror("read");
+         exit(1);
+      }
+      sh->len += n > 0 ? n : 0;
+   }
+}
+
+// a field (VmHWM: or VmSize:) of pid's /proc status in kB, or -1 if
+// /proc doesn't say
+long proc_status_kb(pid_t pid, const char *field) {
+   char path[64], row[256];
+   size_t len = strlen(field);
+   long kb = -1;
+   snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+   FILE *f = fopen(path, "r");
+   if (f == NULL) {
+      return -1;
+   }
+   while (fgets(row, sizeof(row), f) != NULL) {
+      if (strncmp(row, field, len) == 0 && sscanf(row + len, "%ld", &kb) == 1) {
+         break;
+      }
+   }
+   fclose(f);
+   return kb;
+}
+
+// VmHWM of pid in kB, or -1 if /proc doesn't say
+long peak_rss(pid_t pid) {
+   return proc_status_kb(pid, "VmHWM:");
+}
+
+// tell the shell to exit and collect it; its maxrss if /proc was no help
+long shell_stop(struct shell *sh, long rss) {
+   struct rusage ru;
+   int status;
+   close(sh->to); // end of input == exit
+   close(sh->from);
+   if (wait4(sh->pid, &status, 0, &ru) == -1) {
+      perror("wait4");
+      return rss;
+   }
+   return rss != -1 ? rss : ru.ru_maxrss;
+}
+
+static int cmp_double(const void *a, const void *b) {
+   double x = *(const double *)a, y = *(const double *)b;
+   return (x > y) - (x < y);
+}
+
+// the command line for run i of a workload, marker included
+size_t make_line(const char *workload, int i, char *line, size_t cap) {
+   size_t len;
+   if (strcmp(workload, "fg") == 0) {
+      len = snprintf(line, cap, "/bin/true; echo @@\n");
+   }
+   else if (strcmp(workload, "bg") == 0) {
+      len = snprintf(line, cap, "/bin/true & echo @@\n");
+   }
+   else if (strcmp(workload, "redirect") == 0) {
+      len = snprintf(line, cap, "/bin/cat < /tmp/smallsh-bench.in > /tmp/smallsh-bench.out;"
+                                " echo @@\n");
+   }
+   else if (strcmp(workload, "loop") == 0) {
+      len = snprintf(line, cap, "for i in");
+      for (int a = 0; a < LOOP_ITEMS; a++) {
+         len += snprintf(line + len, cap - len, " %d", a);
+      }
+      len += snprintf(line + len, cap - len, "; do true");
+      for (int a = 0; a < LOOP_ARGS; a++) {
+         len += snprintf(line + len, cap - len, " $i");
+      }
+      len += snprintf(line + len, cap - len, "; done; echo @@\n");
+   }
+   else { // longargs
+      len = snprintf(line, cap, "/bin/true");
+      for (int a = 0; a < LONG_ARGS; a++) {
+         len += snprintf(line + len, cap - len, " a%d-%d", a, i);
+      }
+      len += snprintf(line + len, cap - len, "; echo @@\n");
+   }
+   return len;
+}
+
+// Returns 0 if the workload's check (if it has one) failed.
+int bench(const char *shell_path, const char *workload, int n) {
+   static char line[LONG_ARGS * 16 + 64];
+   struct shell sh;
+   double *lat = malloc(n * sizeof(double));
+   double start, total;
+   long vm_first = -1;
+   int ok = 1;
+
+   if (lat == NULL) {
+      perror("malloc");
+      exit(1);
+   }
+   shell_start(&sh, shell_path);
+   shell_run(&sh, "echo @@\n", 8); // wait for it to be up
+
+   start = now();
+   for (int i = 0; i < n; i++) {
+      size_t len = make_line(workload, i, line, sizeof(line));
+      double t = now();
+      shell_run(&sh, line, len);
+      lat[i] = now() - t;
+      if (i == 0) {
+         vm_first = proc_status_kb(sh.pid, "VmSize:");
+      }
+   }
+   total = now() - start;
+
+   long vm_last = proc_status_kb(sh.pid, "VmSize:");
+   if (strcmp(workload, "loop") == 0 && vm_first != -1 && vm_last > vm_first + LOOP_SLACK) {
+      fprintf(stderr, "bench: loop: the shell's VmSize grew from %ld to %ld kB\n",
+              vm_first, vm_last);
+      ok = 0;
+   }
+   long rss = shell_stop(&sh, peak_rss(sh.pid));
+   qsort(lat, n, sizeof(double), cmp_double);
+   printf("%-10s %8d %10.0f %10.1f %10.1f %10ld\n", workload, n, n / total,
+          lat[n / 2] * 1e6, lat[(int)(n * 0.99)] * 1e6, rss);
+   fflush(stdout);
+   free(lat);
+   return ok;
+}
+
+int main(int argc, char *argv[]) {
+   static const char *const workloads[] = { "fg", "bg", "redirect", "longargs", "loop", NULL };
+   const char *shell_path = "./smallsh";
+   const char *only = NULL; // just this workload
+   int n = 1000;
+   int ok = 1;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "n:w:")) != -1) {
+      if (opt == 'n') {
+         n = atoi(optarg);
+      }
+      else if (opt == 'w') {
+         only = optarg;
+      }
+      else {
+         fprintf(stderr, "usage: bench [-n N] [-w fg|bg|redirect|longargs|loop] [smallsh]\n");
+         exit(2);
+      }
+   }
+   if (optind < argc) {
+      shell_path = argv[optind];
+   }
+   if (n < 1) {
+      n = 1;
+   }
+   signal(SIGPIPE, SIG_IGN);
+
+   // input for the redirect workload
+   FILE *in = fopen("/tmp/smallsh-bench.in", "w");
+   if (in == NULL) {
+      perror("/tmp/smallsh-bench.in");
+      exit(1);
+   }
+   for (int i = 0; i < 256; i++) {
+      fprintf(in, "line %d of the redirect workload input\n", i);
+   }
+   fclose(in);
+
+   printf("%-10s %8s %10s %10s %10s %10s\n", "workload", "cmds", "cmds/s",
+          "p50 us", "p99 us", "rss kB");
+   for (int w = 0; workloads[w] != NULL; w++) {
+      if (only == NULL || strcmp(only, workloads[w]) == 0) {
+         ok &= bench(shell_path, workloads[w], n);
+      }
+   }
+   unlink("/tmp/smallsh-bench.in");
+   unlink("/tmp/smallsh-bench.out");
+   return ok ? 0 : 1;
+}
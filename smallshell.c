@@ -5,108 +5,6284 @@
  * 
  * FEATURES:
  *    - The shell handles the following built-in commands:
- *         ls, cd, status, exit
+ *         ls, cd, status, exit, hash, time, parallel, ulimit, history,
+ *         throttle, trace (see tracing), and in-process echo, true,
+ *         false, test/[ and printf
  *    - The rest of the commands are passed into exec()
  *    - Comments (i.e., lines beginning with the '#' char) are supported
- *    - Allow for the redirection of stdin and stdout
+ *    - Runs interactively, or non-interactively from a script file or
+ *      a -c command string (no prompt when stdin isn't a terminal), or
+ *      as a server running command lines sent over a Unix socket
+ *    - Redirections: < > >> on stdin/stdout or on any fd 0-9 (2> log),
+ *      and N>&M / N<&M to copy an fd, N>&- to close one
+ *    - Here-docs (<<EOF, <<-EOF) and here-strings (<<< word), kept in
+ *      memory, never in a temp file
+ *    - Pipelines (cmd1 | cmd2 | ...)
+ *    - Command lists (cmd1; cmd2), cmd1 && cmd2, cmd1 || cmd2, ( subshells )
+ *      and for, while & if, run in-process,
+ *      with $name / ${name} expansion of loop variables, and $$, $? & $!
+ *    - Globbing (*, ?, [...]) in command args and for lists
+ *    - pin (cpus or NUMA nodes) and limit (rlimits, cgroup) prefixes
+ *      for running one command on its own terms
  *    - Supports both foreground and background processes, controllable
  *      by the command line and by receiving signals
+ *    - Job control when interactive: ctrl-z stops the foreground job,
+ *      and jobs, fg, bg & wait manage them
+ *    - Bgr job reports are batched up until the next prompt; set
+ *      $SMALLSH_NOTIFY to summary or quiet for less of them
+ *    - Launches can be rate limited and the # of children capped
+ *      (throttle, $SMALLSH_SPAWN_RATE, $SMALLSH_MAX_CHILDREN)
+ *    - History in ~/.smallsh_history when interactive, with !! & !prefix
+ *    - Optionally saves its state (cwd, environment, variables, path
+ *      cache) to $SMALLSH_STATE on exit and restores it on startup
  */
+#define _GNU_SOURCE // pipe2(), F_SETPIPE_SZ
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <signal.h>
+#include <errno.h>
+#include <spawn.h>
+#include <time.h>
+#include <dirent.h>
+#include <termios.h>
+#include <poll.h>
 
+extern char **environ;
 
+
+////////////////////////////////////////////////////////////////////////
+// job notices
+////////////////////////////////////////////////////////////////////////
+// What the shell has to say on its own account (a bgr job finished or
+// stopped, ctrl-c or ctrl-z at the prompt) doesn't go out as it happens.
+// It piles up in one buffer and is written, together with the prompt, by
+// a single writev() right before the shell waits for input again, so a
+// hundred jobs finishing at once is one syscall, not a few hundred.
+//
+// $SMALLSH_NOTIFY picks how finished bgr jobs are reported: "full" (the
+// default) gives the pid, exit value and usage of each, "summary" one
+// line per batch ("12 jobs done, 1 failed"), and "quiet" nothing. Jobs
+// that stop are always reported.
+////////////////////////////////////////////////////////////////////////
+enum notify_mode { NOTIFY_FULL, NOTIFY_SUMMARY, NOTIFY_QUIET };
+
+struct notices {
+   char *buf;
+   size_t len, cap;
+   int done; // bgr jobs finished since the last flush, for the summary
+   int failed; // and how many of those didn't exit 0
+};
+
+enum notify_mode notify_mode = NOTIFY_FULL;
+struct notices notices;
+
+void notify_mode_init(const char *mode) {
+   if (mode == NULL || *mode == '\0' || strcmp(mode, "full") == 0) {
+      notify_mode = NOTIFY_FULL;
+   }
+   else if (strcmp(mode, "summary") == 0) {
+      notify_mode = NOTIFY_SUMMARY;
+   }
+   else if (strcmp(mode, "quiet") == 0) {
+      notify_mode = NOTIFY_QUIET;
+   }
+   else {
+      fprintf(stderr, "SMALLSH_NOTIFY: %s: expected full, summary or quiet\n", mode);
+   }
+}
+
+// add a line (or a few) to the pending notices, printf style
+void notice(const char *fmt, ...) {
+   va_list ap;
+   int n;
+
+   for (;;) {
+      va_start(ap, fmt);
+      n = vsnprintf(notices.buf + notices.len, notices.cap - notices.len, fmt, ap);
+      va_end(ap);
+      if (n < 0) {
+         return;
+      }
+      if (notices.len + n < notices.cap) {
+         notices.len += n;
+         return;
+      }
+      notices.cap = (notices.len + n + 1) * 2;
+      notices.buf = realloc(notices.buf, notices.cap);
+      if (notices.buf == NULL) { perror("realloc"); exit(1); }
+   }
+}
+
+int notices_pending(void) {
+   return notices.len > 0 || notices.done > 0;
+}
+
+// Write out the pending notices followed by prompt (NULL for none), all
+// in one go. Whatever stdout already has buffered goes first.
+void notices_flush(const char *prompt) {
+   struct iovec iov[2], *v = iov;
+   int num = 0;
+
+   if (notices.done > 0) {
+      notice("%d job%s done", notices.done, notices.done == 1 ? "" : "s");
+      if (notices.failed > 0) {
+         notice(", %d failed", notices.failed);
+      }
+      notice("\n");
+      notices.done = notices.failed = 0;
+   }
+   fflush(stdout);
+   if (notices.len > 0) {
+      iov[num].iov_base = notices.buf;
+      iov[num++].iov_len = notices.len;
+   }
+   if (prompt != NULL) {
+      iov[num].iov_base = (char *)prompt;
+      iov[num++].iov_len = strlen(prompt);
+   }
+   while (num > 0) {
+      ssize_t n = writev(STDOUT_FILENO, v, num);
+      if (n == -1) {
+         if (errno == EINTR) {
+            continue;
+         }
+         break; // nowhere to put them, they're dropped
+      }
+      for (int i = 0; i < num; i++) { // skip what got written
+         size_t took = (size_t)n < v[i].iov_len ? (size_t)n : v[i].iov_len;
+         v[i].iov_base = (char *)v[i].iov_base + took;
+         v[i].iov_len -= took;
+         n -= took;
+      }
+      while (num > 0 && v->iov_len == 0) {
+         v++;
+         num--;
+      }
+   }
+   notices.len = 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// signal handling
+////////////////////////////////////////////////////////////////////////
+// SIGINT, SIGTSTP and SIGCHLD all land in one non-blocking self-pipe.
+// A handler only sets what the shell must see right away (caught_sigint
+// to stop a loop, the foreground-only flag) and drops a byte naming the
+// signal into the pipe; nothing is printed from a handler. The shell
+// drains the pipe when it gets to a good spot (queueing up any notices
+// for the user, see job notices), and while it's waiting
+// for input it poll()s the pipe along with the input (see reader_wait()),
+// so a burst of signals costs one read() between commands instead of a
+// write() per signal landing in the middle of whatever it was printing.
+////////////////////////////////////////////////////////////////////////
+volatile sig_atomic_t fg_only_mode = 0; // keeps track of whether we're in foreground only mode
+volatile sig_atomic_t caught_sigint = 0; // ctrl-c'd, stop any running loop
+int signal_pipe[2] = { -1, -1 }; // [0] read end, [1] write end
+int fg_only_shown = 0; // the mode last announced to the user
+
+// tell the main loop which signal came in
+void signal_note(char tag) {
+   int saved_errno = errno;
+   write(signal_pipe[1], &tag, 1); // if the pipe is full, a wakeup's pending
+   errno = saved_errno;
+}
+
+// catch ctrl-c
+void catchSIGINT(int signo) {
+   caught_sigint = 1;
+   signal_note('i');
+}
+
+// catch ctrl-z
+void catchSIGTSTP (int signo) {
+   fg_only_mode = !fg_only_mode;
+   signal_note('z');
+}
+
+// catch child state changes
+void catchSIGCHLD(int signo) {
+   signal_note('c');
+}
+
+// Empty the pipe and print what the signals in it call for. Returns
+// nonzero if a child changed state, so there's reaping to do.
+int signals_drain(void) {
+   char drain[64];
+   int chld = 0, intr = 0;
+   ssize_t n;
+
+   while ((n = read(signal_pipe[0], drain, sizeof(drain))) > 0) {
+      chld |= memchr(drain, 'c', n) != NULL;
+      intr |= memchr(drain, 'i', n) != NULL;
+   }
+   if (intr) {
+      notice("Caught SIGINT\n");
+   }
+   // an even # of ctrl-z's since last time is no change at all
+   if (fg_only_shown != fg_only_mode) {
+      fg_only_shown = fg_only_mode;
+      notice(fg_only_shown ? "Entering foreground-only mode (& is now ignored)\n"
+                           : "Exiting foreground-only mode\n");
+   }
+   return chld;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// resource accounting
+////////////////////////////////////////////////////////////////////////
+// Every process is collected with wait4(), which hands back its rusage
+// along with the status. A job's usage is the sum over all its processes
+// (max RSS is the biggest of them), plus the wall time from launch to the
+// last process ending. It shows up in `status -v`, in the background
+// "process N completed" report, and in the `time` prefix.
+////////////////////////////////////////////////////////////////////////
+struct usage {
+   double real; // wall clock seconds
+   struct rusage ru; // user/sys cpu, max rss, context switches
+};
+
+double timespec_secs(const struct timespec *ts) {
+   return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+double timeval_secs(const struct timeval *tv) {
+   return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// seconds since start on the monotonic clock
+double secs_since(const struct timespec *start) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return timespec_secs(&now) - timespec_secs(start);
+}
+
+void rusage_add(struct rusage *sum, const struct rusage *ru) {
+   timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+   timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+   if (ru->ru_maxrss > sum->ru_maxrss) {
+      sum->ru_maxrss = ru->ru_maxrss;
+   }
+   sum->ru_nvcsw += ru->ru_nvcsw;
+   sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+void usage_clear(struct usage *u) {
+   memset(u, 0, sizeof(struct usage));
+}
+
+#define USAGE_FORMAT "real %.3fs user %.3fs sys %.3fs maxrss %ldkB ctxsw %ld/%ld\n"
+#define USAGE_ARGS(u) (u)->real, timeval_secs(&(u)->ru.ru_utime), \
+   timeval_secs(&(u)->ru.ru_stime), (u)->ru.ru_maxrss, (u)->ru.ru_nvcsw, (u)->ru.ru_nivcsw
+
+// one line summary, for status -v (bgr completion reports notice() it)
+void print_usage(const struct usage *u) {
+   printf(USAGE_FORMAT, USAGE_ARGS(u));
+}
+
+// bash style report for the time prefix, on stderr
+void print_time(double real, const struct rusage *ru) {
+   double user = timeval_secs(&ru->ru_utime);
+   double sys = timeval_secs(&ru->ru_stime);
+   fflush(stdout);
+   fprintf(stderr, "\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+           (int)real / 60, real - 60 * ((int)real / 60),
+           (int)user / 60, user - 60 * ((int)user / 60),
+           (int)sys / 60, sys - 60 * ((int)sys / 60));
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// tracing
+////////////////////////////////////////////////////////////////////////
+// Built with -DSMALLSH_TRACE (make TRACE=1, and smallsh-debug), every
+// phase of running a command (reading the line, parsing it, expanding
+// words, the $PATH lookup, the spawn, waiting for it, built-ins and
+// reaping) gets timed on the monotonic clock into a fixed ring buffer,
+// for as long as `trace on` is in effect:
+//
+//    trace on           start a fresh trace
+//    trace off          stop recording (what's in the ring stays)
+//    trace dump [csv]   write the ring out as Chrome trace JSON (load it
+//                       in chrome://tracing or Perfetto), or as CSV
+//    trace              say whether it's on and how much it holds
+//
+// With tracing off each phase costs one predictable branch; compiled
+// out, the TRACE_ macros are empty and cost nothing at all.
+////////////////////////////////////////////////////////////////////////
+enum trace_phase { TRACE_READ, TRACE_PARSE, TRACE_EXPAND, TRACE_LOOKUP, TRACE_SPAWN,
+                   TRACE_WAIT, TRACE_BUILTIN, TRACE_REAP };
+
+#ifdef SMALLSH_TRACE
+#define TRACE_RING 4096 // power of 2
+
+const char *const trace_names[] = {
+   "read", "parse", "expand", "lookup", "spawn", "wait", "builtin", "reap"
+};
+
+struct trace_event {
+   uint64_t start; // ns on the monotonic clock
+   uint64_t dur; // ns
+   long arg; // pid, parse cache hit, # of children reaped
+   int phase; // enum trace_phase
+};
+
+struct trace_event trace_ring[TRACE_RING];
+uint64_t trace_count = 0; // events recorded, the ring keeps the last TRACE_RING
+int trace_enabled = 0;
+
+static uint64_t trace_now(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void trace_record(int phase, uint64_t start, long arg) {
+   struct trace_event *e = &trace_ring[trace_count++ & (TRACE_RING - 1)];
+   e->start = start;
+   e->dur = trace_now() - start;
+   e->arg = arg;
+   e->phase = phase;
+}
+
+// a start of 0 means tracing was off when the phase began
+#define TRACE_START(t) uint64_t t = trace_enabled ? trace_now() : 0
+#define TRACE_END(t, phase, arg) \
+   do { if (trace_enabled && (t) != 0) trace_record(phase, t, arg); } while (0)
+
+int trace_builtin(char **args, int num_args) {
+   uint64_t first = trace_count > TRACE_RING ? trace_count - TRACE_RING : 0;
+   uint64_t i;
+
+   if (num_args == 1) {
+      printf("trace is %s, %llu events\n", trace_enabled ? "on" : "off",
+             (unsigned long long)(trace_count - first));
+   }
+   else if (strcmp(args[1], "on") == 0) {
+      trace_count = 0;
+      trace_enabled = 1;
+   }
+   else if (strcmp(args[1], "off") == 0) {
+      trace_enabled = 0;
+   }
+   else if (strcmp(args[1], "dump") == 0 && num_args > 2 && strcmp(args[2], "csv") == 0) {
+      printf("phase,start_us,dur_us,arg\n");
+      for (i = first; i < trace_count; i++) {
+         struct trace_event *e = &trace_ring[i & (TRACE_RING - 1)];
+         printf("%s,%.3f,%.3f,%ld\n", trace_names[e->phase], e->start / 1e3,
+                e->dur / 1e3, e->arg);
+      }
+   }
+   else if (strcmp(args[1], "dump") == 0) {
+      printf("{\"traceEvents\":[");
+      for (i = first; i < trace_count; i++) {
+         struct trace_event *e = &trace_ring[i & (TRACE_RING - 1)];
+         printf("%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":0,\"args\":{\"arg\":%ld}}", i == first ? "" : ",",
+                trace_names[e->phase], e->start / 1e3, e->dur / 1e3, (int)getpid(), e->arg);
+      }
+      printf("\n]}\n");
+   }
+   else {
+      fprintf(stderr, "usage: trace [on | off | dump [csv]]\n");
+      return 2;
+   }
+   return 0;
+}
+#else
+#define TRACE_START(t) do { } while (0)
+#define TRACE_END(t, phase, arg) do { } while (0)
+
+int trace_builtin(char **args, int num_args) {
+   fprintf(stderr, "trace: not built in, compile with -DSMALLSH_TRACE\n");
+   return 1;
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////
+// job table
+////////////////////////////////////////////////////////////////////////
+// One slot per job (a pipeline of one or more processes; the foreground
+// one too, so it can be stopped and picked up again), in a growable
+// array. Slots of finished jobs go on a free list and get reused (along
+// with their pid and cmdline buffers), running jobs are chained on a live
+// list so nothing ever has to walk dead entries, and a pid -> slot hash
+// (open addressing, linear probing) makes finding the job for a reaped
+// pid O(1). A pid leaves the hash as soon as it has been reaped.
+////////////////////////////////////////////////////////////////////////
+enum job_state { JOB_FREE, JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+struct job {
+   int state; // enum job_state
+   pid_t pgid; // process group, i.e. pid of the first process
+   pid_t *pids; // every process in the job, -1 for ones that didn't start
+   int num_pids; // # of entries in pids
+   int pids_cap; // size of the pids buffer, kept across reuse
+   int live; // # of processes not reaped yet
+   int batch; // started by the parallel built-in, not reported
+   int foreground; // the shell is waiting on it right now
+   unsigned long seq; // when it last went to the bgr or stopped (for %+)
+   struct termios tmodes; // terminal settings it had when it stopped
+   int has_tmodes;
+   char *cmdline; // command line that started the job
+   size_t cmdline_cap; // size of the cmdline buffer, kept across reuse
+   struct timespec start; // CLOCK_MONOTONIC launch time
+   int status; // waitpid() status of the last process, once JOB_DONE
+   struct usage usage; // summed over the processes reaped so far
+   int prev, next; // live list links, or free list link (next) if free
+};
+
+struct job *jobs = NULL; // the table, indexed by job # - 1
+int jobs_cap = 0; // # of slots in jobs
+int job_free = -1; // head of the free list
+int job_live = -1; // head of the live list
+int num_jobs = 0; // # of slots on the live list
+unsigned long job_seq = 0; // last job->seq handed out
+
+struct pid_slot {
+   pid_t pid; // 0 == empty
+   int job;
+};
+struct pid_slot *pid_index = NULL;
+int pid_index_cap = 0; // power of 2, kept at least twice pid_index_used
+int pid_index_used = 0; // # of pids in pid_index
+
+static unsigned pid_hash(pid_t pid) {
+   return (unsigned)pid * 2654435761u;
+}
+
+static void pid_index_put(pid_t pid, int job) {
+   unsigned mask = pid_index_cap - 1;
+   unsigned i = pid_hash(pid) & mask;
+   while (pid_index[i].pid != 0) {
+      i = (i + 1) & mask;
+   }
+   pid_index[i].pid = pid;
+   pid_index[i].job = job;
+   pid_index_used++;
+}
+
+static void pid_index_grow(void) {
+   struct pid_slot *old = pid_index;
+   int old_cap = pid_index_cap;
+   pid_index_cap = old_cap == 0 ? 64 : old_cap * 2;
+   pid_index = calloc(pid_index_cap, sizeof(struct pid_slot));
+   if (pid_index == NULL) { perror("calloc"); exit(1); }
+   pid_index_used = 0;
+   for (int i = 0; i < old_cap; i++) {
+      if (old[i].pid != 0) {
+         pid_index_put(old[i].pid, old[i].job);
+      }
+   }
+   free(old);
+}
+
+// remove pid, shifting later members of its probe run back into the gap
+// so lookups never need tombstones
+static void pid_index_del(pid_t pid) {
+   unsigned mask = pid_index_cap - 1;
+   unsigned i = pid_hash(pid) & mask;
+   while (pid_index[i].pid != pid) {
+      if (pid_index[i].pid == 0) {
+         return;
+      }
+      i = (i + 1) & mask;
+   }
+   unsigned gap = i;
+   for (;;) {
+      i = (i + 1) & mask;
+      if (pid_index[i].pid == 0) {
+         break;
+      }
+      unsigned home = pid_hash(pid_index[i].pid) & mask;
+      // can the entry at i move back to the gap without passing its home?
+      if (((i - home) & mask) >= ((i - gap) & mask)) {
+         pid_index[gap] = pid_index[i];
+         gap = i;
+      }
+   }
+   pid_index[gap].pid = 0;
+   pid_index_used--;
+}
+
+// job for pid, or NULL if pid isn't one of our jobs
+struct job *job_by_pid(pid_t pid) {
+   if (pid_index_cap == 0) {
+      return NULL;
+   }
+   unsigned mask = pid_index_cap - 1;
+   unsigned i = pid_hash(pid) & mask;
+   while (pid_index[i].pid != 0) {
+      if (pid_index[i].pid == pid) {
+         return &jobs[pid_index[i].job];
+      }
+      i = (i + 1) & mask;
+   }
+   return NULL;
+}
+
+// start tracking a new job made of the running processes in pids[]
+struct job *job_add(const pid_t *pids, int num_pids, const char *cmdline) {
+   int slot;
+   int i;
+   size_t len = strlen(cmdline);
+
+   if (job_free == -1) { // no free slots, double the table
+      int old_cap = jobs_cap;
+      jobs_cap = old_cap == 0 ? 16 : old_cap * 2;
+      jobs = realloc(jobs, jobs_cap * sizeof(struct job));
+      if (jobs == NULL) { perror("realloc"); exit(1); }
+      for (slot = jobs_cap - 1; slot >= old_cap; slot--) {
+         jobs[slot].state = JOB_FREE;
+         jobs[slot].cmdline = NULL;
+         jobs[slot].cmdline_cap = 0;
+         jobs[slot].pids = NULL;
+         jobs[slot].pids_cap = 0;
+         jobs[slot].next = job_free;
+         job_free = slot;
+      }
+   }
+   while ((pid_index_used + num_pids) * 2 > pid_index_cap) {
+      pid_index_grow();
+   }
+
+   slot = job_free;
+   struct job *job = &jobs[slot];
+   job_free = job->next;
+
+   job->state = JOB_RUNNING;
+   if (num_pids > job->pids_cap) {
+      job->pids_cap = num_pids;
+      job->pids = realloc(job->pids, job->pids_cap * sizeof(pid_t));
+      if (job->pids == NULL) { perror("realloc"); exit(1); }
+   }
+   memcpy(job->pids, pids, num_pids * sizeof(pid_t));
+   job->num_pids = num_pids;
+   job->pgid = -1;
+   job->live = 0;
+   job->batch = 0;
+   job->foreground = 0;
+   job->seq = ++job_seq;
+   job->has_tmodes = 0;
+   for (i = 0; i < num_pids; i++) {
+      if (pids[i] != -1) {
+         if (job->pgid == -1) {
+            job->pgid = pids[i];
+         }
+         job->live++;
+         pid_index_put(pids[i], slot);
+      }
+   }
+   if (len + 1 > job->cmdline_cap) {
+      job->cmdline_cap = len + 1;
+      job->cmdline = realloc(job->cmdline, job->cmdline_cap);
+      if (job->cmdline == NULL) { perror("realloc"); exit(1); }
+   }
+   memcpy(job->cmdline, cmdline, len + 1);
+   clock_gettime(CLOCK_MONOTONIC, &job->start);
+   // a last stage that never started counts as exit value 1
+   job->status = pids[num_pids - 1] == -1 ? W_EXITCODE(1, 0) : 0;
+   usage_clear(&job->usage);
+
+   job->prev = -1; // push onto the live list
+   job->next = job_live;
+   if (job_live != -1) {
+      jobs[job_live].prev = slot;
+   }
+   job_live = slot;
+   num_jobs++;
+   return job;
+}
+
+// stop tracking a job and put its slot back on the free list
+void job_remove(struct job *job) {
+   int slot = job - jobs;
+   for (int i = 0; i < job->num_pids && job->live > 0; i++) {
+      if (job->pids[i] != -1 && job_by_pid(job->pids[i]) == job) {
+         pid_index_del(job->pids[i]);
+         job->live--;
+      }
+   }
+   if (job->prev != -1) {
+      jobs[job->prev].next = job->next;
+   }
+   else {
+      job_live = job->next;
+   }
+   if (job->next != -1) {
+      jobs[job->next].prev = job->prev;
+   }
+   num_jobs--;
+   job->state = JOB_FREE;
+   job->next = job_free;
+   job_free = slot;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// SIGCHLD handling & reaping background processes
+////////////////////////////////////////////////////////////////////////
+// The SIGCHLD handler just drops a byte into the signal pipe (see signal
+// handling). Before each prompt, and whenever the pipe wakes the reader,
+// the shell checks it: if no SIGCHLD is in it, no child has changed state
+// and there is nothing to do. Otherwise it collects every finished (or
+// stopped) child with
+// waitpid(-1, WNOHANG | WUNTRACED),
+// so reaping costs O(completed processes) instead of a waitpid per slot
+// ever used. Callers that need a job slot to free up (JOBS_MAX, parallel,
+// spawn limits) sleep until at least one child is done.
+////////////////////////////////////////////////////////////////////////
+int batch_live = 0; // # of parallel built-in jobs still running
+int batch_failed = 0; // # of parallel built-in jobs that exited non-zero
+pid_t last_done_pgid = -1; // the job that finished last, for `wait %n`
+int last_done_status = 0;
+
+// collect every background process that has finished, and report the
+// jobs whose last process is gone. Returns the # of processes reaped.
+int reap_children(int block) {
+   int status;
+   struct rusage ru;
+   int options = block ? WUNTRACED : WNOHANG | WUNTRACED;
+   int reaped = 0;
+   pid_t pid;
+   struct job *job;
+
+   // empty the pipe before reaping so no wakeup is lost
+   if (!signals_drain() && !block) {
+      return 0; // no SIGCHLD since last time
+   }
+   TRACE_START(reap_start);
+   while ((pid = wait4(-1, &status, options, &ru)) > 0) {
+      options = WNOHANG | WUNTRACED; // blocking mode only waits for the first one
+      reaped++;
+      if ((job = job_by_pid(pid)) == NULL) {
+         continue; // not a bgr job of ours
+      }
+      if (WIFSTOPPED(status)) { // e.g. it tried to read the terminal
+         if (job->state == JOB_RUNNING && !job->batch) {
+            job->state = JOB_STOPPED;
+            job->seq = ++job_seq;
+            notice("[%d]+  %-24s%s\n", (int)(job - jobs) + 1, "Stopped", job->cmdline);
+         }
+         continue;
+      }
+      pid_index_del(pid);
+      rusage_add(&job->usage.ru, &ru);
+      job->live--;
+      if (pid == job->pids[job->num_pids - 1]) { // pipeline's status
+         job->status = status;
+      }
+      if (job->live > 0) {
+         continue; // rest of the pipeline is still going
+      }
+      job->state = JOB_DONE;
+      job->usage.real = secs_since(&job->start);
+      status = job->status;
+      last_done_pgid = job->pgid;
+      last_done_status = status;
+      if (job->batch) { // parallel built-in only keeps score
+         batch_live--;
+         if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            batch_failed++;
+         }
+         job_remove(job);
+         continue;
+      }
+      if (notify_mode == NOTIFY_FULL) { // display pid & exit value/sig
+         notice("process %d completed\n", job->pgid);
+         if (WIFEXITED(status) != 0) {
+            notice("exit value %d\n", WEXITSTATUS(status));
+         } // if exited by signal instead
+         else if (WIFSIGNALED(status) != 0) {
+            notice("term sig was %d\n", WTERMSIG(status));
+         }
+         notice(USAGE_FORMAT, USAGE_ARGS(&job->usage));
+      }
+      else if (notify_mode == NOTIFY_SUMMARY) {
+         notices.done++;
+         notices.failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+      }
+      job_remove(job);
+   }
+   TRACE_END(reap_start, TRACE_REAP, reaped);
+   return reaped;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+// spawn limits
+/////////////////////////////////////////////////////////////////////////
+// Two brakes on starting processes, so a runaway loop of & jobs can't
+// fork-bomb the machine and a burst of launches gets smoothed out:
+//
+//  - a token bucket: up to burst processes at once, refilled at rate a
+//    second ($SMALLSH_SPAWN_RATE, $SMALLSH_SPAWN_BURST, default 64)
+//  - a cap on how many child processes run at once ($SMALLSH_MAX_CHILDREN)
+//
+// Both are off (0) unless they're set, and `throttle` changes them on the
+// fly. A launch that would go over waits its turn instead of failing, for
+// tokens to come in or for some job to end; ctrl-c gives up on it. A
+// pipeline goes as a whole (its stages have to run together), even one
+// bigger than the burst or the cap on its own, and the cap doesn't hold
+// anything up while no job that could end is running. How many launches
+// had to wait, and for how long, shows in `status -v`.
+/////////////////////////////////////////////////////////////////////////
+struct spawn_limits {
+   double rate; // tokens a second, 0 for no rate limit
+   double burst; // most tokens the bucket holds
+   int max_children; // 0 for no cap
+   double tokens;
+   struct timespec refilled; // when tokens was last brought up to date
+   unsigned long launched; // processes started
+   unsigned long by_rate; // launches that waited for tokens
+   unsigned long by_cap; // and for a job to end
+   double waited; // seconds spent waiting, all told
+};
+
+struct spawn_limits spawn_limit = { 0, 64, 0, 64 };
+
+// top the bucket up for the time since it was last
+static void spawn_refill(void) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   spawn_limit.tokens += (timespec_secs(&now) - timespec_secs(&spawn_limit.refilled))
+                         * spawn_limit.rate;
+   if (spawn_limit.tokens > spawn_limit.burst) {
+      spawn_limit.tokens = spawn_limit.burst;
+   }
+   spawn_limit.refilled = now;
+}
+
+void spawn_set(double rate, double burst, int max_children) {
+   spawn_limit.rate = rate;
+   spawn_limit.burst = burst;
+   spawn_limit.max_children = max_children;
+   spawn_limit.tokens = burst; // a fresh bucket starts out full
+   clock_gettime(CLOCK_MONOTONIC, &spawn_limit.refilled);
+}
+
+// processes of jobs that are running, i.e. could end and free up a slot
+static int children_running(void) {
+   int n = 0;
+   for (int i = job_live; i != -1; i = jobs[i].next) {
+      if (jobs[i].state == JOB_RUNNING) {
+         n += jobs[i].live;
+      }
+   }
+   return n;
+}
+
+// Wait until n more processes may start, and count them as started.
+// Returns 0 if ctrl-c cut the wait short: don't start them after all.
+int spawn_wait(int n) {
+   struct pollfd pipe_fd = { signal_pipe[0], POLLIN, 0 };
+   struct timespec start;
+   int waited = 0;
+
+   while (spawn_limit.max_children > 0 && !caught_sigint) {
+      int running = children_running();
+      if (running == 0 || running + n <= spawn_limit.max_children) {
+         break;
+      }
+      if (!waited) {
+         clock_gettime(CLOCK_MONOTONIC, &start);
+         spawn_limit.by_cap++;
+         waited = 1;
+      }
+      poll(&pipe_fd, 1, -1); // a SIGCHLD (or a ctrl-c) comes in
+      reap_children(0);
+   }
+   while (spawn_limit.rate > 0 && !caught_sigint) {
+      double need = n < spawn_limit.burst ? n : spawn_limit.burst;
+      spawn_refill();
+      if (spawn_limit.tokens >= need) {
+         spawn_limit.tokens -= n; // a big pipeline goes into debt
+         break;
+      }
+      if (waited < 2) {
+         if (!waited) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+         }
+         spawn_limit.by_rate++;
+         waited = 2;
+      }
+      double secs = (need - spawn_limit.tokens) / spawn_limit.rate;
+      struct timespec ts = { (time_t)secs, (long)((secs - (time_t)secs) * 1e9) + 1 };
+      nanosleep(&ts, NULL); // any signal wakes it, then look again
+   }
+   if (waited) {
+      spawn_limit.waited += secs_since(&start);
+   }
+   if (caught_sigint) {
+      return 0;
+   }
+   spawn_limit.launched += n;
+   return 1;
+}
+
+void spawn_limits_init(void) {
+   const char *rate = getenv("SMALLSH_SPAWN_RATE");
+   const char *burst = getenv("SMALLSH_SPAWN_BURST");
+   const char *max = getenv("SMALLSH_MAX_CHILDREN");
+   spawn_set(rate != NULL ? atof(rate) : 0, burst != NULL && atof(burst) >= 1 ? atof(burst) : 64,
+             max != NULL ? atoi(max) : 0);
+}
+
+// the counters, for status -v and throttle
+void print_spawn_stats(void) {
+   printf("spawned %lu, %lu waited for the rate and %lu for the cap, %.3fs in all\n",
+          spawn_limit.launched, spawn_limit.by_rate, spawn_limit.by_cap, spawn_limit.waited);
+}
+
+// throttle [-r rate] [-b burst] [-c max children] (built-in)
+int throttle_builtin(char **args, int num_args) {
+   double rate = spawn_limit.rate, burst = spawn_limit.burst;
+   int max_children = spawn_limit.max_children;
+
+   for (int i = 1; i < num_args; i += 2) {
+      char *end;
+      double value = i + 1 < num_args ? strtod(args[i + 1], &end) : -1;
+      if (value < 0 || *end != '\0' || args[i + 1][0] == '\0') {
+         fprintf(stderr, "usage: throttle [-r rate] [-b burst] [-c max children]\n");
+         return 2;
+      }
+      if (strcmp(args[i], "-r") == 0) {
+         rate = value;
+      }
+      else if (strcmp(args[i], "-b") == 0 && value >= 1) {
+         burst = value;
+      }
+      else if (strcmp(args[i], "-c") == 0) {
+         max_children = (int)value;
+      }
+      else {
+         fprintf(stderr, "usage: throttle [-r rate] [-b burst] [-c max children]\n");
+         return 2;
+      }
+   }
+   if (num_args > 1) {
+      spawn_set(rate, burst, max_children);
+      return 0;
+   }
+   printf("rate %g/s, burst %g, max children %d\n", rate, burst, max_children);
+   print_spawn_stats();
+   return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// per-command arena
+////////////////////////////////////////////////////////////////////////
+// Everything that only lives for one trip through the shell loop (tokens,
+// the argv vector, redirection file names, $$ expansions) is carved out of
+// a single block that is reset at the top of each iteration. If a command
+// needs more than the block holds, extra blocks get chained on, and the
+// next reset folds them into one bigger block. Steady state: no mallocs.
+////////////////////////////////////////////////////////////////////////
+#define ARENA_ALIGN 16
+
+struct arena_block {
+   struct arena_block *prev; // older block in the chain (or NULL)
+   size_t size; // usable bytes in data[]
+   size_t used; // bytes handed out so far
+   char data[];
+};
+
+struct arena {
+   struct arena_block *head; // block we're currently carving from
+   size_t total; // sum of all block sizes in the chain
+   size_t peak; // most total has been since the last reset
+   struct arena_block *spare; // overflow block arena_restore() kept, or NULL
+};
+
+static struct arena_block *arena_new_block(size_t size) {
+   struct arena_block *b = malloc(sizeof(struct arena_block) + size);
+   if (b == NULL) { perror("malloc"); exit(1); }
+   b->prev = NULL;
+   b->size = size;
+   b->used = 0;
+   return b;
+}
+
+void arena_init(struct arena *a, size_t size) {
+   a->head = arena_new_block(size);
+   a->total = a->peak = size;
+   a->spare = NULL;
+}
+
+// hand out n bytes, aligned for any pointer/integer type
+void *arena_alloc(struct arena *a, size_t n) {
+   struct arena_block *b = a->head;
+   size_t off = (b->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+   if (off + n > b->size) { // doesn't fit, chain on a new block
+      size_t size = b->size * 2;
+      while (size < n) {
+         size *= 2;
+      }
+      if (a->spare != NULL && a->spare->size >= size) { // a loop's next pass
+         b = a->spare;
+         a->spare = NULL;
+         size = b->size;
+      }
+      else {
+         b = arena_new_block(size);
+      }
+      b->prev = a->head;
+      a->head = b;
+      a->total += size;
+      if (a->total > a->peak) {
+         a->peak = a->total;
+      }
+      off = 0;
+   }
+   b->used = off + n;
+   return b->data + off;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t len) {
+   char *p = arena_alloc(a, len + 1);
+   memcpy(p, s, len);
+   p[len] = '\0';
+   return p;
+}
+
+char *arena_strdup(struct arena *a, const char *s) {
+   return arena_strndup(a, s, strlen(s));
+}
+
+// where an arena is at, for giving back what's allocated after it
+struct arena_mark {
+   struct arena_block *block;
+   size_t used;
+};
+
+struct arena_mark arena_save(struct arena *a) {
+   struct arena_mark m = { a->head, a->head->used };
+   return m;
+}
+
+// give back everything handed out since arena_save(), so a loop running
+// the same commands over and over doesn't keep growing the arena. The
+// freed blocks come off total; peak still remembers them, so the next
+// reset sizes up for the most one pass needed, not for every pass. The
+// biggest one is kept as the spare, for the next pass to overflow into
+// without a malloc.
+void arena_restore(struct arena *a, struct arena_mark m) {
+   while (a->head != m.block) {
+      struct arena_block *b = a->head;
+      a->head = b->prev;
+      a->total -= b->size;
+      if (a->spare == NULL || b->size > a->spare->size) {
+         free(a->spare);
+         a->spare = b;
+      }
+      else {
+         free(b);
+      }
+   }
+   a->head->used = m.used;
+}
+
+// forget everything handed out; if the last command overflowed into
+// several blocks, replace them with one block big enough for all of them
+// at once
+void arena_reset(struct arena *a) {
+   if (a->peak > a->head->size) {
+      struct arena_block *b = a->head;
+      while (b != NULL) {
+         struct arena_block *prev = b->prev;
+         free(b);
+         b = prev;
+      }
+      free(a->spare); // the new block has room for what it was for
+      a->spare = NULL;
+      a->head = arena_new_block(a->peak);
+   }
+   a->total = a->peak = a->head->size;
+   a->head->used = 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// command path cache
 ////////////////////////////////////////////////////////////////////////
-// SIGINT & SIGTSTP handling
+// execvp() walks every $PATH directory (one failing execve per entry) on
+// every launch. Instead, remember where each command name was found, like
+// bash's `hash`, so repeat launches are a single execve. The table is
+// thrown away whenever $PATH changes, and an entry is dropped and looked
+// up again if its file disappears (ENOENT at launch time).
 ////////////////////////////////////////////////////////////////////////
-int fg_only_mode = 0; // keeps track of whether we're in foreground only mode
+#define PATH_BUCKETS 128 // power of 2
+
+struct path_entry {
+   char *name; // command name as typed
+   char *path; // where we found it
+   unsigned hits; // # of launches served from the table
+   struct path_entry *next; // next entry in the same bucket
+};
+
+struct path_entry *path_table[PATH_BUCKETS];
+int path_table_size = 0; // # of entries in path_table
+char *path_table_path = NULL; // copy of the $PATH the table was built with
+
+// FNV-1a, good enough for short command names
+unsigned hash_string(const char *s) {
+   unsigned h = 2166136261u;
+   while (*s != '\0') {
+      h = (h ^ (unsigned char)*s++) * 16777619u;
+   }
+   return h;
+}
+
+void path_cache_clear(void) {
+   for (int i = 0; i < PATH_BUCKETS; i++) {
+      struct path_entry *e = path_table[i];
+      while (e != NULL) {
+         struct path_entry *next = e->next;
+         free(e->name);
+         free(e->path);
+         free(e);
+         e = next;
+      }
+      path_table[i] = NULL;
+   }
+   path_table_size = 0;
+}
+
+// drop the table if $PATH is no longer what it was built against
+static void path_cache_check_path(void) {
+   const char *path = getenv("PATH");
+   if (path == NULL) {
+      path = "";
+   }
+   if (path_table_path == NULL || strcmp(path, path_table_path) != 0) {
+      path_cache_clear();
+      free(path_table_path);
+      path_table_path = strdup(path);
+   }
+}
+
+static struct path_entry **path_cache_find(const char *name) {
+   struct path_entry **e = &path_table[hash_string(name) & (PATH_BUCKETS - 1)];
+   while (*e != NULL && strcmp((*e)->name, name) != 0) {
+      e = &(*e)->next;
+   }
+   return e;
+}
+
+void path_cache_forget(const char *name) {
+   struct path_entry **e = path_cache_find(name);
+   if (*e != NULL) {
+      struct path_entry *dead = *e;
+      *e = dead->next;
+      free(dead->name);
+      free(dead->path);
+      free(dead);
+      path_table_size--;
+   }
+}
+
+// walk $PATH the way execvp would; an empty entry means the cwd
+static char *path_search(const char *name) {
+   const char *dir = path_table_path;
+   size_t name_len = strlen(name);
+   struct stat sb;
+   for (;;) {
+      const char *end = strchr(dir, ':');
+      size_t dir_len = end != NULL ? (size_t)(end - dir) : strlen(dir);
+      char *candidate = malloc(dir_len + name_len + 3);
+      if (candidate == NULL) { perror("malloc"); exit(1); }
+      if (dir_len == 0) {
+         candidate[0] = '.';
+         dir_len = 1;
+      }
+      else {
+         memcpy(candidate, dir, dir_len);
+      }
+      candidate[dir_len] = '/';
+      memcpy(candidate + dir_len + 1, name, name_len + 1);
+      if (stat(candidate, &sb) == 0 && S_ISREG(sb.st_mode)
+          && access(candidate, X_OK) == 0) {
+         return candidate;
+      }
+      free(candidate);
+      if (end == NULL) {
+         return NULL;
+      }
+      dir = end + 1;
+   }
+}
+
+// resolve a command name to the file to exec. Names with a slash in them
+// are used as-is. Returns NULL (errno = ENOENT) if it isn't on $PATH.
+const char *path_lookup(const char *name, int count_hit) {
+   if (strchr(name, '/') != NULL) {
+      return name;
+   }
+   path_cache_check_path();
+   struct path_entry **e = path_cache_find(name);
+   if (*e == NULL) { // miss, go find it
+      char *path = path_search(name);
+      if (path == NULL) {
+         errno = ENOENT;
+         return NULL;
+      }
+      *e = malloc(sizeof(struct path_entry));
+      if (*e == NULL) { perror("malloc"); exit(1); }
+      (*e)->name = strdup(name);
+      (*e)->path = path;
+      (*e)->hits = 0;
+      (*e)->next = NULL;
+      path_table_size++;
+   }
+   if (count_hit) {
+      (*e)->hits++;
+   }
+   return (*e)->path;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// hash command (built-in)
+/////////////////////////////////////////////////////////////////////////
+//   hash              list remembered commands and their hit counts
+//   hash -r           forget everything
+//   hash -d name...   forget the given commands
+//   hash name...      look the given commands up and remember them
+/////////////////////////////////////////////////////////////////////////
+void hash_builtin(char **args, int num_args) {
+   int i;
+   if (num_args == 1) {
+      path_cache_check_path();
+      if (path_table_size == 0) {
+         printf("hash: hash table empty\n");
+         return;
+      }
+      printf("hits\tcommand\n");
+      for (i = 0; i < PATH_BUCKETS; i++) {
+         for (struct path_entry *e = path_table[i]; e != NULL; e = e->next) {
+            printf("%4u\t%s\n", e->hits, e->path);
+         }
+      }
+   }
+   else if (strcmp(args[1], "-r") == 0) {
+      path_cache_clear();
+   }
+   else if (strcmp(args[1], "-d") == 0) {
+      path_cache_check_path();
+      for (i = 2; i < num_args; i++) {
+         path_cache_forget(args[i]);
+      }
+   }
+   else {
+      for (i = 1; i < num_args; i++) {
+         if (strchr(args[i], '/') == NULL && path_lookup(args[i], 0) == NULL) {
+            printf("hash: %s: not found\n", args[i]);
+         }
+      }
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// shell variables
+////////////////////////////////////////////////////////////////////////
+// Set by `for` and read back by $name expansions. A small chained hash
+// table; a variable keeps its value buffer and overwrites it in place, so
+// a loop assigning the same name every iteration doesn't malloc. Names
+// that aren't shell variables fall back to the environment.
+//
+// The special parameters $$, $? and $! aren't in the table, they're
+// read straight out of these, and neither are the script's arguments
+// ($0, $1 ... $9, ${10} and so on, and $# for how many).
+////////////////////////////////////////////////////////////////////////
+#define VAR_BUCKETS 64 // power of 2
+
+pid_t shell_pid; // $$, looked up once in main()
+int last_status = 0; // $?, exit code of the last command run
+pid_t last_bg_pid = -1; // $!, last process of the last bgr job (-1 none yet)
+char **script_args = NULL; // $0, $1, ..., set up in main()
+int num_script_args = 0; // # of them, $0 included
+
+struct var {
+   char *name;
+   char *value;
+   size_t value_cap; // size of the value buffer
+   struct var *next; // next variable in the same bucket
+};
+
+struct var *var_table[VAR_BUCKETS];
+
+// FNV-1a again, for names that aren't '\0' terminated
+static unsigned hash_name(const char *name, size_t len) {
+   unsigned h = 2166136261u;
+   for (size_t i = 0; i < len; i++) {
+      h = (h ^ (unsigned char)name[i]) * 16777619u;
+   }
+   return h;
+}
+
+static struct var *var_find(const char *name, size_t len) {
+   struct var *v = var_table[hash_name(name, len) & (VAR_BUCKETS - 1)];
+   for (; v != NULL; v = v->next) {
+      if (strncmp(v->name, name, len) == 0 && v->name[len] == '\0') {
+         return v;
+      }
+   }
+   return NULL;
+}
+
+void var_set(const char *name, const char *value) {
+   size_t len = strlen(name);
+   size_t value_len = strlen(value);
+   struct var *v = var_find(name, len);
+   if (v == NULL) {
+      struct var **bucket = &var_table[hash_name(name, len) & (VAR_BUCKETS - 1)];
+      v = malloc(sizeof(struct var));
+      if (v == NULL) { perror("malloc"); exit(1); }
+      v->name = strdup(name);
+      v->value = NULL;
+      v->value_cap = 0;
+      v->next = *bucket;
+      *bucket = v;
+   }
+   if (value_len + 1 > v->value_cap) {
+      v->value_cap = value_len + 1 > 32 ? value_len + 1 : 32;
+      v->value = realloc(v->value, v->value_cap);
+      if (v->value == NULL) { perror("realloc"); exit(1); }
+   }
+   memcpy(v->value, value, value_len + 1);
+}
+
+// value of name (len bytes, not '\0' terminated), or NULL if it's unset
+const char *var_get(const char *name, size_t len) {
+   char env_name[256];
+   struct var *v = var_find(name, len);
+   if (v != NULL) {
+      return v->value;
+   }
+   if (len >= sizeof(env_name)) {
+      return NULL;
+   }
+   memcpy(env_name, name, len);
+   env_name[len] = '\0';
+   return getenv(env_name);
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// state snapshot
+////////////////////////////////////////////////////////////////////////
+// If $SMALLSH_STATE names a file, the shell saves its state there when
+// it exits (exit or end of input) and picks it back up when it starts:
+// the cwd, the environment, the shell variables and the command path
+// cache (with the $PATH it was built against), so a fresh shell doesn't
+// have to search $PATH all over again. Variables that are in the
+// environment the shell was started with win over saved ones, and a
+// path cache saved against a different $PATH is thrown away as usual.
+//
+// The file is mmap()ed and read in place. All numbers are native
+// uint32s; strings are a uint32 length followed by the bytes and a '\0':
+//
+//    "SMALLSH" version(1) # env # vars # paths
+//    cwd  table's $PATH
+//    env:   "NAME=value"...
+//    vars:  name value...
+//    paths: name path hits...
+//
+// It's written to a temp file that is renamed over the old one, so a
+// shell starting up never sees half of one. A file that doesn't look
+// right is ignored.
+////////////////////////////////////////////////////////////////////////
+#define STATE_MAGIC "SMALLSH"
+#define STATE_VERSION 1
+
+char *state_file = NULL; // $SMALLSH_STATE, if it was set
+
+struct state_reader {
+   const char *p; // next byte
+   const char *end;
+};
+
+static int state_u32(struct state_reader *r, uint32_t *n) {
+   if (r->end - r->p < (ptrdiff_t)sizeof(uint32_t)) {
+      return 0;
+   }
+   memcpy(n, r->p, sizeof(uint32_t));
+   r->p += sizeof(uint32_t);
+   return 1;
+}
+
+// the next string, pointing into the map, or NULL if the file is bad
+static const char *state_str(struct state_reader *r) {
+   uint32_t len;
+   const char *s;
+   if (!state_u32(r, &len) || (size_t)(r->end - r->p) < (size_t)len + 1 || r->p[len] != '\0') {
+      return NULL;
+   }
+   s = r->p;
+   r->p += len + 1;
+   return s;
+}
+
+void state_load(const char *file) {
+   struct state_reader r;
+   struct stat sb;
+   uint32_t version, num_env, num_vars, num_paths, hits, i;
+   const char *cwd, *table_path, *name, *value;
+   int fd = open(file, O_RDONLY | O_CLOEXEC);
+
+   if (fd == -1) {
+      return; // nothing saved yet
+   }
+   if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(STATE_MAGIC)) {
+      close(fd);
+      return;
+   }
+   char *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      perror("mmap");
+      return;
+   }
+   r.p = map + sizeof(STATE_MAGIC);
+   r.end = map + sb.st_size;
+   if (memcmp(map, STATE_MAGIC, sizeof(STATE_MAGIC)) != 0 || !state_u32(&r, &version)
+       || version != STATE_VERSION || !state_u32(&r, &num_env) || !state_u32(&r, &num_vars)
+       || !state_u32(&r, &num_paths) || (cwd = state_str(&r)) == NULL
+       || (table_path = state_str(&r)) == NULL) {
+      munmap(map, sb.st_size);
+      return;
+   }
+
+   if (chdir(cwd) == -1) {
+      perror(cwd);
+   }
+   for (i = 0; i < num_env && (name = state_str(&r)) != NULL; i++) {
+      const char *eq = strchr(name, '=');
+      if (eq != NULL) {
+         char *var = strndup(name, eq - name);
+         setenv(var, eq + 1, 0); // what we were started with wins
+         free(var);
+      }
+   }
+   for (i = 0; i < num_vars && (name = state_str(&r)) != NULL
+               && (value = state_str(&r)) != NULL; i++) {
+      var_set(name, value);
+   }
+   path_cache_clear();
+   free(path_table_path);
+   path_table_path = strdup(table_path);
+   for (i = 0; i < num_paths && (name = state_str(&r)) != NULL
+               && (value = state_str(&r)) != NULL && state_u32(&r, &hits); i++) {
+      struct path_entry **e = path_cache_find(name);
+      if (*e == NULL) {
+         *e = malloc(sizeof(struct path_entry));
+         if (*e == NULL) { perror("malloc"); exit(1); }
+         (*e)->name = strdup(name);
+         (*e)->path = strdup(value);
+         (*e)->hits = hits;
+         (*e)->next = NULL;
+         path_table_size++;
+      }
+   }
+   munmap(map, sb.st_size);
+}
+
+static void state_put_u32(FILE *f, uint32_t n) {
+   fwrite(&n, sizeof(n), 1, f);
+}
+
+static void state_put_str(FILE *f, const char *s) {
+   uint32_t len = strlen(s);
+   state_put_u32(f, len);
+   fwrite(s, 1, len + 1, f);
+}
+
+void state_save(const char *file) {
+   char cwd[4096];
+   uint32_t num_env = 0, num_vars = 0;
+   struct var *v;
+   struct path_entry *e;
+   int i;
+
+   size_t len = strlen(file);
+   char *tmp = malloc(len + 8);
+   if (tmp == NULL) { perror("malloc"); exit(1); }
+   memcpy(tmp, file, len);
+   memcpy(tmp + len, ".XXXXXX", 8);
+   int fd = mkstemp(tmp);
+   FILE *f = fd != -1 ? fdopen(fd, "w") : NULL;
+   if (f == NULL) {
+      perror(file);
+      free(tmp);
+      return;
+   }
+
+   while (environ[num_env] != NULL) {
+      num_env++;
+   }
+   for (i = 0; i < VAR_BUCKETS; i++) {
+      for (v = var_table[i]; v != NULL; v = v->next) {
+         num_vars++;
+      }
+   }
+   if (getcwd(cwd, sizeof(cwd)) == NULL) {
+      strcpy(cwd, "/");
+   }
+   fwrite(STATE_MAGIC, 1, sizeof(STATE_MAGIC), f);
+   state_put_u32(f, STATE_VERSION);
+   state_put_u32(f, num_env);
+   state_put_u32(f, num_vars);
+   state_put_u32(f, path_table_size);
+   state_put_str(f, cwd);
+   state_put_str(f, path_table_path != NULL ? path_table_path : "");
+   for (i = 0; environ[i] != NULL; i++) {
+      state_put_str(f, environ[i]);
+   }
+   for (i = 0; i < VAR_BUCKETS; i++) {
+      for (v = var_table[i]; v != NULL; v = v->next) {
+         state_put_str(f, v->name);
+         state_put_str(f, v->value);
+      }
+   }
+   for (i = 0; i < PATH_BUCKETS; i++) {
+      for (e = path_table[i]; e != NULL; e = e->next) {
+         state_put_str(f, e->name);
+         state_put_str(f, e->path);
+         state_put_u32(f, e->hits);
+      }
+   }
+   if (fclose(f) != 0 || rename(tmp, file) == -1) {
+      perror(file);
+      unlink(tmp);
+   }
+   free(tmp);
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// reading command lines
+////////////////////////////////////////////////////////////////////////
+// Input is pulled in with big read()s and split into lines with memchr,
+// so a long script costs one syscall per 64KiB instead of one stdio call
+// per line. Lines can be any length, the buffer just grows. A -c command
+// string is fed through the same reader with the whole string already
+// "read".
+//
+// Nothing the shell printf()s reaches the terminal or pipe until stdout
+// is flushed, so flush it right before we'd block waiting for more input
+// (and before launching anything) rather than after every line.
+//
+// Waiting for input is a poll() on the input and the signal pipe, so a
+// child finishing or a ctrl-z at the prompt is dealt with (and reported,
+// with the prompt put back after it) as it happens, not on the next line.
+////////////////////////////////////////////////////////////////////////
+#define READ_CHUNK 65536
+
+struct reader {
+   int fd; // where lines come from, -1 for a -c string
+   char *buf;
+   size_t cap; // size of buf
+   size_t start; // first byte of the next line
+   size_t end; // one past the last byte read so far
+   int eof; // nothing more to read() after buf runs out
+   const char *prompt; // what to show again after a notice, NULL for none
+};
+
+void reader_init_fd(struct reader *r, int fd) {
+   r->fd = fd;
+   r->cap = READ_CHUNK;
+   r->buf = malloc(r->cap);
+   if (r->buf == NULL) { perror("malloc"); exit(1); }
+   r->start = r->end = 0;
+   r->eof = 0;
+   r->prompt = NULL;
+}
+
+void reader_init_string(struct reader *r, const char *s) {
+   size_t len = strlen(s);
+   r->fd = -1;
+   r->cap = len + 1;
+   r->buf = malloc(r->cap);
+   if (r->buf == NULL) { perror("malloc"); exit(1); }
+   memcpy(r->buf, s, len);
+   r->start = 0;
+   r->end = len;
+   r->eof = 1;
+   r->prompt = NULL;
+}
+
+// Sleep until r->fd has something to read (or hit its end), handling
+// signals as they arrive instead of letting them interrupt the read().
+void reader_wait(struct reader *r) {
+   struct pollfd fds[2] = { { r->fd, POLLIN, 0 }, { signal_pipe[0], POLLIN, 0 } };
+   for (;;) {
+      if (poll(fds, 2, -1) == -1) {
+         if (errno == EINTR) {
+            continue; // the pipe will say which signal it was
+         }
+         return; // leave it to read() to block or fail
+      }
+      if (fds[1].revents != 0) {
+         reap_children(0);
+         if (notices_pending()) {
+            notices_flush(r->prompt);
+         }
+      }
+      if (fds[0].revents != 0) {
+         return;
+      }
+   }
+}
+
+// Returns the next line with its newline replaced by a '\0', or NULL at end
+// of input. The line stays valid until the next call.
+char *reader_getline(struct reader *r) {
+   size_t scanned = 0; // bytes already known not to hold a '\n'
+   for (;;) {
+      char *line = r->buf + r->start;
+      char *nl = memchr(line + scanned, '\n', r->end - r->start - scanned);
+      if (nl != NULL) {
+         *nl = '\0';
+         r->start = nl - r->buf + 1;
+         return line;
+      }
+      scanned = r->end - r->start;
+      if (r->eof) { // last line might not end in a '\n'
+         if (scanned == 0) {
+            return NULL;
+         }
+         line[scanned] = '\0'; // always room, see below
+         r->start = r->end;
+         return line;
+      }
+
+      // need more input: slide the partial line to the front, make room
+      if (r->start > 0) {
+         memmove(r->buf, line, scanned);
+         r->start = 0;
+         r->end = scanned;
+      }
+      if (r->cap - r->end < READ_CHUNK / 2) {
+         r->cap *= 2;
+         r->buf = realloc(r->buf, r->cap);
+         if (r->buf == NULL) { perror("realloc"); exit(1); }
+      }
+      fflush(stdout); // about to block, let the user see everything so far
+      reader_wait(r);
+      ssize_t n = read(r->fd, r->buf + r->end, r->cap - r->end - 1);
+      if (n > 0) {
+         r->end += n;
+      }
+      else if (n == 0 || errno != EINTR) {
+         r->eof = 1;
+      }
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// tokenizing command lines
+////////////////////////////////////////////////////////////////////////
+// One linear pass over the line. A word is a slice of the line itself:
+// quotes and backslashes are squeezed out in place (a word never gets
+// longer than its source text) and a '\0' is written where it ends, so
+// argv can point straight into the line buffer. Nothing gets copied and
+// there's no limit on the size of a token.
+//
+// Quoting works like sh: '...' is taken literally, "..." too except for
+// \\ \" \$ and \`, and outside quotes a backslash escapes the next char.
+// Unquoted <, >, |, &, ;, (, ) and newlines are operators even with no
+// blanks around them, and so are &&, ||, >>, <&, >&, <<, <<- and <<<.
+// Digits right in front of a < or > (2>, 2>>, 2>&1) are the fd it
+// redirects, not a word.
+//
+// A here-doc's body is the lines after the one with its <<, so when the
+// lexer gets to the end of that line it reads the bodies itself, each up
+// to its delimiter, and carries on after them. If the input runs out
+// first the line is incomplete, same as an unfinished for/while/if. An
+// unquoted delimiter means $$ and $name in the body are expanded.
+//
+// Expansions ($$, $?, $!, $name, ${name}) can't be done here, the syntax
+// tree gets cached and re-run, so a word that has one is also split into
+// parts: slices of literal text and expansion nodes that are evaluated
+// each time it runs.
+// A variable's name is written out in place like literal text, so the
+// part can point at it.
+////////////////////////////////////////////////////////////////////////
+enum token_type { TOK_END, TOK_WORD, TOK_LT, TOK_GT, TOK_DGREAT, TOK_LTAND, TOK_GTAND,
+                  TOK_DLESS, TOK_DLESSDASH, TOK_TLESS, TOK_PIPE, TOK_AMP, TOK_SEMI,
+                  TOK_AND_IF, TOK_OR_IF, TOK_LPAREN, TOK_RPAREN, TOK_NEWLINE, TOK_ERROR };
+
+enum part_type { PART_TEXT, PART_PID, PART_STATUS, PART_LAST_BG, PART_VAR, PART_ARG,
+                 PART_NUM_ARGS };
+
+struct word_part {
+   int type; // enum part_type
+   const char *text; // PART_TEXT: literal slice of the word, PART_VAR: name
+   size_t len; // PART_ARG: which argument
+
+   int quoted; // inside "...", so an expansion isn't split into fields
+   struct word_part *next;
+};
+
+struct word {
+   char *text; // the word after quote removal, '\0' terminated
+   struct word_part *parts; // NULL if text is used as-is
+   int quoted; // some of it was quoted/escaped (so "<" is just a word)
+   int glob; // has an unquoted *, ? or [ (and no quoted ones), see globbing
+   struct word *next; // next word of the same command
+};
+
+struct token {
+   int type; // enum token_type
+   struct word *word; // TOK_WORD only, allocated in the lexer's arena
+   int fd; // redirections: the fd written in front of it, -1 if none
+};
+
+struct heredoc {
+   const char *delim; // the word after <<, quotes removed
+   int expand; // delimiter wasn't quoted: $ expansions in the body
+   int strip_tabs; // <<-: leading tabs come off every line
+   struct word *body; // filled in at the end of the line
+   struct heredoc *next; // next one waiting for its body
+};
+
+struct lexer {
+   char *line;
+   size_t pos; // next char to look at
+   size_t start; // where the last token started
+   char held; // operator char at pos that a word's '\0' was written over
+   struct arena *arena; // for words and their parts
+   struct heredoc *heredocs; // started on this line, bodies not read yet
+   struct heredoc **heredocs_tail;
+   int heredoc_missing; // input ran out before a here-doc's delimiter
+};
+
+void lexer_init(struct lexer *lx, char *line, struct arena *a) {
+   lx->line = line;
+   lx->pos = 0;
+   lx->start = 0;
+   lx->held = '\0';
+   lx->arena = a;
+   lx->heredocs = NULL;
+   lx->heredocs_tail = &lx->heredocs;
+   lx->heredoc_missing = 0;
+}
+
+static int is_blank(char c) {
+   return c == ' ' || c == '\t' || c == '\r';
+}
+
+static int is_operator(char c) {
+   return c == '<' || c == '>' || c == '|' || c == '&' || c == ';' || c == '('
+          || c == ')' || c == '\n';
+}
+
+static int is_glob_char(char c) {
+   return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+static int is_name_char(char c, int first) {
+   return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+          || (!first && c >= '0' && c <= '9');
+}
+
+// add a part to the end of a word's part list
+static struct word_part **add_part(struct arena *a, struct word_part **tail, int type,
+                                   const char *text, size_t len, int quoted) {
+   struct word_part *p = arena_alloc(a, sizeof(struct word_part));
+   p->type = type;
+   p->text = text;
+   p->len = len;
+   p->quoted = quoted;
+   p->next = NULL;
+   *tail = p;
+   return &p->next;
+}
+
+// what the word scanner in next_token() is up to
+struct scan {
+   size_t r, w, seg; // read & write positions, start of the current literal
+   struct word_part **tail; // where the next part of the word goes
+};
+
+// $$, $?, $!, $#, $n, ${n}, $name or ${name} at line[sc->r]: end the
+// literal so far and add the expansion as a part. Returns 0 if the $
+// doesn't start one (it's just a '$').
+static int scan_dollar(struct lexer *lx, struct scan *sc, int quoted) {
+   char *line = lx->line;
+   char c = line[sc->r + 1];
+   int braces = c == '{';
+   char first = braces ? line[sc->r + 2] : c;
+   int digits = first >= '0' && first <= '9'; // an argument's #
+   size_t name, end;
+   if (braces) { // ${name} or ${n}, only if it's closed
+      for (end = sc->r + 2; digits ? line[end] >= '0' && line[end] <= '9'
+                                   : is_name_char(line[end], end == sc->r + 2); end++) {
+         ;
+      }
+      if (end == sc->r + 2 || line[end] != '}') {
+         return 0;
+      }
+   }
+   else if (c != '$' && c != '?' && c != '!' && c != '#' && !digits && !is_name_char(c, 1)) {
+      return 0;
+   }
+   if (sc->w > sc->seg) {
+      sc->tail = add_part(lx->arena, sc->tail, PART_TEXT, line + sc->seg,
+                          sc->w - sc->seg, quoted);
+   }
+   if (c == '$' || c == '?' || c == '!' || c == '#') { // filled in when it runs
+      sc->tail = add_part(lx->arena, sc->tail,
+                          c == '$' ? PART_PID : c == '?' ? PART_STATUS
+                          : c == '!' ? PART_LAST_BG : PART_NUM_ARGS,
+                          NULL, 0, quoted);
+      sc->r += 2;
+   }
+   else if (digits) { // an argument: $1 is one digit, ${12} can be more
+      size_t n = 0;
+      sc->r += 1 + braces;
+      do {
+         n = n * 10 + (line[sc->r++] - '0');
+      } while (braces && line[sc->r] != '}');
+      sc->r += braces; // the '}'
+      sc->tail = add_part(lx->arena, sc->tail, PART_ARG, NULL, n, quoted);
+   }
+   else { // a variable, its name kept in the word's text
+      name = sc->w;
+      for (sc->r += 1 + braces; is_name_char(line[sc->r], 0); sc->r++) {
+         line[sc->w++] = line[sc->r];
+      }
+      sc->r += braces; // the '}'
+      sc->tail = add_part(lx->arena, sc->tail, PART_VAR, line + name,
+                          sc->w - name, quoted);
+   }
+   sc->seg = sc->w;
+   return 1;
+}
+
+// the body of h, line[start] up to (not including) line[end], as a word
+static struct word *heredoc_body(struct lexer *lx, struct heredoc *h, size_t start,
+                                 size_t end) {
+   char *line = lx->line;
+   struct word *word = arena_alloc(lx->arena, sizeof(struct word));
+   struct scan sc;
+   int bol = 1; // at the beginning of a line
+
+   word->text = line + start;
+   word->parts = NULL;
+   word->quoted = 1; // never split into fields
+   word->glob = 0;
+   word->next = NULL;
+   sc.tail = &word->parts;
+   sc.r = sc.w = sc.seg = start;
+   while (sc.r < end) {
+      char c = line[sc.r];
+      if (bol && h->strip_tabs && c == '\t') {
+         sc.r++;
+         continue;
+      }
+      bol = c == '\n';
+      if (h->expand && c == '$' && scan_dollar(lx, &sc, 1)) {
+         continue;
+      }
+      if (h->expand && c == '\\' && strchr("\\$`", line[sc.r + 1]) != NULL) {
+         sc.r++;
+      }
+      line[sc.w++] = line[sc.r++];
+   }
+   if (word->parts != NULL && sc.w > sc.seg) {
+      add_part(lx->arena, sc.tail, PART_TEXT, line + sc.seg, sc.w - sc.seg, 1);
+   }
+   line[sc.w] = '\0'; // lands on the delimiter line, which is done with
+   return word;
+}
+
+// at the start of the line after some <<s: read their bodies and move
+// past them. Returns 0 if the input ends before one of the delimiters.
+static int read_heredocs(struct lexer *lx) {
+   char *line = lx->line;
+   for (struct heredoc *h = lx->heredocs; h != NULL; h = h->next) {
+      size_t len = strlen(h->delim);
+      size_t start = lx->pos;
+      size_t bol, text, eol;
+      for (bol = start; ; bol = eol + 1) {
+         for (text = bol; h->strip_tabs && line[text] == '\t'; text++) {
+            ;
+         }
+         for (eol = text; line[eol] != '\0' && line[eol] != '\n'; eol++) {
+            ;
+         }
+         if (eol - text == len && memcmp(line + text, h->delim, len) == 0) {
+            break;
+         }
+         if (line[eol] == '\0') {
+            lx->pos = eol;
+            lx->heredoc_missing = 1;
+            return 0;
+         }
+      }
+      lx->pos = line[eol] == '\n' ? eol + 1 : eol;
+      h->body = heredoc_body(lx, h, start, bol);
+   }
+   lx->heredocs = NULL;
+   lx->heredocs_tail = &lx->heredocs;
+   return 1;
+}
+
+// scan the next token into t, returns its type
+int next_token(struct lexer *lx, struct token *t) {
+   char *line = lx->line;
+   struct word *word;
+   struct scan sc;
+   int quoted_glob = 0; // a quoted *, ? or [ in the word, so it's not a pattern
+   char c;
+
+   if (lx->held != '\0') { // operator right after a word
+      c = lx->held;
+      lx->held = '\0';
+   }
+   else {
+      while (is_blank(line[lx->pos])) {
+         lx->pos++;
+      }
+      c = line[lx->pos];
+   }
+   lx->start = lx->pos;
+   t->fd = -1;
+
+   if (c == '\0') {
+      if (lx->heredocs != NULL) {
+         lx->heredoc_missing = 1;
+      }
+      return t->type = TOK_END;
+   }
+   if (c >= '0' && c <= '9') { // 2> and the like: the digits go with the < or >
+      size_t end = lx->pos;
+      while (line[end] >= '0' && line[end] <= '9') {
+         end++;
+      }
+      if (line[end] == '<' || line[end] == '>') {
+         t->fd = end - lx->pos > 3 ? INT_MAX : atoi(line + lx->pos);
+         lx->pos = end;
+         c = line[end];
+      }
+   }
+   if (is_operator(c)) {
+      lx->pos++; // if c was held, its second char (>>, >&) is still there
+      switch (c) {
+      case '<':
+         if (line[lx->pos] == '&') {
+            lx->pos++;
+            return t->type = TOK_LTAND;
+         }
+         if (line[lx->pos] == '<') {
+            lx->pos++;
+            if (line[lx->pos] == '<' || line[lx->pos] == '-') {
+               return t->type = line[lx->pos++] == '<' ? TOK_TLESS : TOK_DLESSDASH;
+            }
+            return t->type = TOK_DLESS;
+         }
+         return t->type = TOK_LT;
+      case '>':
+         if (line[lx->pos] == '>' || line[lx->pos] == '&') {
+            return t->type = line[lx->pos++] == '>' ? TOK_DGREAT : TOK_GTAND;
+         }
+         return t->type = TOK_GT;
+      case '|':
+         if (line[lx->pos] == '|') {
+            lx->pos++;
+            return t->type = TOK_OR_IF;
+         }
+         return t->type = TOK_PIPE;
+      case '&':
+         if (line[lx->pos] == '&') {
+            lx->pos++;
+            return t->type = TOK_AND_IF;
+         }
+         return t->type = TOK_AMP;
+      case ';': return t->type = TOK_SEMI;
+      case '(': return t->type = TOK_LPAREN;
+      case ')': return t->type = TOK_RPAREN;
+      default:
+         if (lx->heredocs != NULL && !read_heredocs(lx)) {
+            return t->type = TOK_END;
+         }
+         return t->type = TOK_NEWLINE;
+      }
+   }
+
+   word = arena_alloc(lx->arena, sizeof(struct word));
+   word->text = line + lx->pos;
+   word->parts = NULL;
+   word->quoted = 0;
+   word->glob = 0;
+   word->next = NULL;
+   sc.tail = &word->parts;
+   sc.r = sc.w = sc.seg = lx->pos;
+   for (;;) {
+      c = line[sc.r];
+      if (c == '\0' || is_blank(c) || is_operator(c)) {
+         break;
+      }
+      if (c == '\'') { // literal up to the next '
+         word->quoted = 1;
+         for (sc.r++; line[sc.r] != '\''; sc.r++) {
+            if (line[sc.r] == '\0') {
+               return t->type = TOK_ERROR;
+            }
+            quoted_glob |= is_glob_char(line[sc.r]);
+            line[sc.w++] = line[sc.r];
+         }
+         sc.r++;
+         continue;
+      }
+      if (c == '"') { // literal up to the next ", except \ and $
+         word->quoted = 1;
+         for (sc.r++; line[sc.r] != '"'; ) {
+            if (line[sc.r] == '\0') {
+               return t->type = TOK_ERROR;
+            }
+            if (line[sc.r] == '$' && scan_dollar(lx, &sc, 1)) {
+               continue;
+            }
+            if (line[sc.r] == '\\' && line[sc.r + 1] != '\0'
+                && strchr("\\\"$`", line[sc.r + 1]) != NULL) {
+               sc.r++;
+            }
+            quoted_glob |= is_glob_char(line[sc.r]);
+            line[sc.w++] = line[sc.r++];
+         }
+         sc.r++;
+         continue;
+      }
+      if (c == '\\') { // escapes the next char
+         word->quoted = 1;
+         if (line[sc.r + 1] != '\0') {
+            quoted_glob |= is_glob_char(line[sc.r + 1]);
+            line[sc.w++] = line[sc.r + 1];
+            sc.r += 2;
+         }
+         else {
+            sc.r++;
+         }
+         continue;
+      }
+      if (c == '$' && scan_dollar(lx, &sc, 0)) {
+         continue;
+      }
+      word->glob |= is_glob_char(c);
+      line[sc.w++] = line[sc.r++];
+   }
+   word->glob &= !quoted_glob;
+   if (word->parts != NULL && sc.w > sc.seg) { // literal after the last expansion
+      add_part(lx->arena, sc.tail, PART_TEXT, line + sc.seg, sc.w - sc.seg, 0);
+   }
+
+   // end the word in place. If it butts up against an operator and no
+   // quotes were squeezed out, the '\0' lands on the operator: hold it.
+   lx->pos = sc.r;
+   if (c != '\0') {
+      if (sc.w == sc.r && is_operator(c)) {
+         lx->held = c;
+      }
+      else if (sc.w == sc.r) {
+         lx->pos++; // the '\0' replaces a blank we'd skip anyway
+      }
+   }
+   line[sc.w] = '\0';
+   t->word = word;
+   return t->type = TOK_WORD;
+}
+
+// next_token() where a command can start: a '#' there begins a comment
+// that runs to the end of the line
+int next_command_token(struct lexer *lx, struct token *t) {
+   if (lx->held == '\0') {
+      while (is_blank(lx->line[lx->pos])) {
+         lx->pos++;
+      }
+      if (lx->line[lx->pos] == '#') {
+         while (lx->line[lx->pos] != '\0' && lx->line[lx->pos] != '\n') {
+            lx->pos++;
+         }
+      }
+   }
+   return next_token(lx, t);
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// history
+////////////////////////////////////////////////////////////////////////
+// When interactive, every command line gets appended to $SMALLSH_HISTORY
+// (~/.smallsh_history if that's not set, no history if it's set empty)
+// with a single write(), so shells running side by side don't mix their
+// lines up. Inside a multi-line command each line but the last ends in
+// a backslash, so an entry is everything up to a newline without one.
+//
+// Starting up only mmap()s the file, however big it has grown. The first
+// time it's searched, one pass over the mapping finds every entry and an
+// array of them gets sorted by text (a radix sort on their first 8 bytes,
+// packed into an int, does most of it without touching the file). From
+// then on !prefix is a binary search, plus a look along the entries that
+// share the prefix for the newest one. This session's lines are kept in
+// a list of their own that is checked first.
+//
+//    !!            the last command line again
+//    !prefix       the last one that started with prefix
+//    history [n]   list them all, or the last n
+//
+// The other words on a ! line are tacked onto what it stands for, and
+// the result is echoed before it runs, like in bash.
+////////////////////////////////////////////////////////////////////////
+struct hist_entry {
+   uint64_t key; // first 8 bytes, big end first, so it sorts like the text
+   size_t off; // where it starts in the mapping (newer ones further on)
+   size_t len; // up to (not including) its newline
+};
+
+struct history {
+   int fd; // for appending, -1 if there's no history
+   const char *map; // the file as it was at startup
+   size_t map_len;
+   struct hist_entry *entries; // by text, NULL until it's searched
+   size_t num; // # of entries
+   char **added; // this session's lines, as stored
+   size_t num_added;
+   size_t added_cap;
+   char *line; // what the last ! line turned into
+   size_t line_cap;
+};
+
+struct history hist = { -1 };
+
+int high_fd(int fd); // see parsed commands
+
+void history_open(const char *path) {
+   struct stat st;
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+   if (fd != -1) {
+      if (fstat(fd, &st) == 0 && st.st_size > 0) {
+         void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (map != MAP_FAILED) {
+            hist.map = map;
+            hist.map_len = st.st_size;
+         }
+      }
+      close(fd);
+   }
+   hist.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+   if (hist.fd != -1) {
+      hist.fd = high_fd(hist.fd);
+   }
+   if (hist.fd == -1) {
+      perror(path);
+   }
+}
+
+// end of the entry starting at off: its newline, or the end of the file
+static size_t history_entry_end(size_t off) {
+   const char *nl;
+   while ((nl = memchr(hist.map + off, '\n', hist.map_len - off)) != NULL) {
+      if (nl == hist.map || nl[-1] != '\\') {
+         return nl - hist.map;
+      }
+      off = nl - hist.map + 1; // one line of a multi-line command
+   }
+   return hist.map_len;
+}
+
+static int history_cmp(const void *a, const void *b) {
+   const struct hist_entry *x = a, *y = b;
+   int c;
+   if (x->key != y->key) {
+      return x->key < y->key ? -1 : 1;
+   }
+   c = memcmp(hist.map + x->off, hist.map + y->off, x->len < y->len ? x->len : y->len);
+   return c != 0 ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+// Sort entries by text: a byte-at-a-time radix sort on the keys, then
+// whatever still ties (texts with the same first 8 bytes) by comparing
+// the rest. Much cheaper than a comparison sort over the mapping.
+static void history_sort(struct hist_entry *e, size_t n) {
+   struct hist_entry *tmp = malloc(n * sizeof(struct hist_entry)), *from = e, *to = tmp;
+   size_t i, run;
+
+   if (tmp == NULL) { perror("malloc"); exit(1); }
+   for (int shift = 0; shift < 64; shift += 8) {
+      size_t count[257] = { 0 };
+      for (i = 0; i < n; i++) {
+         count[((from[i].key >> shift) & 255) + 1]++;
+      }
+      if (count[((from[0].key >> shift) & 255) + 1] == n) {
+         continue; // they all have the same byte here
+      }
+      for (i = 1; i < 257; i++) {
+         count[i] += count[i - 1];
+      }
+      for (i = 0; i < n; i++) { // stable, so each pass keeps the last one's order
+         to[count[(from[i].key >> shift) & 255]++] = from[i];
+      }
+      struct hist_entry *swap = from;
+      from = to;
+      to = swap;
+   }
+   if (from != e) {
+      memcpy(e, from, n * sizeof(struct hist_entry));
+   }
+   free(tmp);
+   for (i = 0; i < n; i = run) {
+      for (run = i + 1; run < n && e[run].key == e[i].key; run++) {
+         ;
+      }
+      if (run - i > 1) {
+         qsort(e + i, run - i, sizeof(struct hist_entry), history_cmp);
+      }
+   }
+}
+
+// find the entries in the mapping and sort them, the first time only
+static void history_index(void) {
+   size_t off, cap = 0;
+
+   if (hist.entries != NULL || hist.map == NULL) {
+      return;
+   }
+   for (off = 0; off < hist.map_len; off = history_entry_end(off) + 1) {
+      cap++;
+   }
+   hist.entries = malloc(cap * sizeof(struct hist_entry));
+   if (hist.entries == NULL) { perror("malloc"); exit(1); }
+   for (off = 0; off < hist.map_len; hist.num++) {
+      struct hist_entry *e = &hist.entries[hist.num];
+      size_t end = history_entry_end(off);
+      e->off = off;
+      e->len = end - off;
+      e->key = 0;
+      for (size_t i = 0; i < 8; i++) {
+         e->key = e->key << 8 | (i < e->len ? (unsigned char)hist.map[off + i] : 0);
+      }
+      off = end + 1;
+   }
+   if (hist.num > 0) {
+      history_sort(hist.entries, hist.num);
+   }
+}
+
+// The newest entry that starts with prefix (the last one of all if it's
+// ""), as stored, and its length in *len. NULL if there isn't one.
+const char *history_find(const char *prefix, size_t plen, size_t *len) {
+   size_t lo = 0, hi;
+   struct hist_entry *best = NULL;
+
+   for (size_t i = hist.num_added; i-- > 0; ) {
+      if (strncmp(hist.added[i], prefix, plen) == 0) {
+         *len = strlen(hist.added[i]);
+         return hist.added[i];
+      }
+   }
+   if (hist.map == NULL) {
+      return NULL;
+   }
+   if (plen == 0) { // the last entry of the file, no index needed
+      lo = hist.map[hist.map_len - 1] == '\n' ? hist.map_len - 1 : hist.map_len;
+      for (hi = lo; hi > 0 && (hist.map[hi - 1] != '\n' || (hi > 1 && hist.map[hi - 2] == '\\')); hi--) {
+         ;
+      }
+      *len = lo - hi;
+      return hist.map + hi;
+   }
+   history_index();
+   hi = hist.num;
+   while (lo < hi) { // first entry that isn't less than prefix
+      size_t mid = lo + (hi - lo) / 2;
+      struct hist_entry *e = &hist.entries[mid];
+      int c = memcmp(hist.map + e->off, prefix, e->len < plen ? e->len : plen);
+      if (c < 0 || (c == 0 && e->len < plen)) {
+         lo = mid + 1;
+      }
+      else {
+         hi = mid;
+      }
+   }
+   for (; lo < hist.num; lo++) { // the ones with the prefix are all here
+      struct hist_entry *e = &hist.entries[lo];
+      if (e->len < plen || memcmp(hist.map + e->off, prefix, plen) != 0) {
+         break;
+      }
+      if (best == NULL || e->off > best->off) {
+         best = e;
+      }
+   }
+   if (best == NULL) {
+      return NULL;
+   }
+   *len = best->len;
+   return hist.map + best->off;
+}
+
+// an entry as stored back to what was typed: "\\\n" is just a newline
+static size_t history_decode(const char *s, size_t len, char *out) {
+   size_t n = 0;
+   for (size_t i = 0; i < len; i++) {
+      if (s[i] == '\\' && i + 1 < len && s[i + 1] == '\n') {
+         continue;
+      }
+      out[n++] = s[i];
+   }
+   return n;
+}
+
+// remember line, unless it's blank or the same as the one before
+void history_add(const char *line) {
+   size_t len = strlen(line), n = 0;
+   const char *p;
+   char *stored;
+
+   for (p = line; *p == ' ' || *p == '\t'; p++) {
+      ;
+   }
+   if (hist.fd == -1 || *p == '\0') {
+      return;
+   }
+   stored = malloc(2 * len + 2);
+   if (stored == NULL) { perror("malloc"); exit(1); }
+   for (p = line; *p != '\0'; p++) {
+      if (*p == '\n') {
+         stored[n++] = '\\';
+      }
+      stored[n++] = *p;
+   }
+   stored[n] = '\0';
+   if (hist.num_added > 0 && strcmp(hist.added[hist.num_added - 1], stored) == 0) {
+      free(stored);
+      return;
+   }
+   stored[n] = '\n';
+   if (write(hist.fd, stored, n + 1) != (ssize_t)(n + 1)) {
+      perror("history");
+      close(hist.fd); // don't keep trying
+      hist.fd = -1;
+   }
+   stored[n] = '\0';
+   if (hist.num_added == hist.added_cap) {
+      hist.added_cap = hist.added_cap ? 2 * hist.added_cap : 64;
+      hist.added = realloc(hist.added, hist.added_cap * sizeof(char *));
+      if (hist.added == NULL) { perror("realloc"); exit(1); }
+   }
+   hist.added[hist.num_added++] = stored;
+}
+
+// Turn a line starting with ! into the one it stands for (echoing it).
+// NULL, having said so, if there's nothing it could be.
+char *history_expand(char *line) {
+   size_t plen, len, rest_len;
+   const char *found;
+   char *rest;
+
+   if (line[1] == '\0' || is_blank(line[1]) || line[1] == '=') {
+      return line; // a lone ! isn't history
+   }
+   for (rest = line + 1; *rest != '\0' && !is_blank(*rest); rest++) {
+      ;
+   }
+   plen = line[1] == '!' && rest == line + 2 ? 0 : rest - line - 1;
+   found = history_find(line + 1, plen, &len);
+   if (found == NULL) {
+      fprintf(stderr, "smallsh: %.*s: event not found\n", (int)(rest - line), line);
+      return NULL;
+   }
+   rest_len = strlen(rest);
+   if (len + rest_len + 1 > hist.line_cap) {
+      hist.line_cap = 2 * (len + rest_len + 1);
+      hist.line = realloc(hist.line, hist.line_cap);
+      if (hist.line == NULL) { perror("realloc"); exit(1); }
+   }
+   len = history_decode(found, len, hist.line);
+   memcpy(hist.line + len, rest, rest_len + 1);
+   printf("%s\n", hist.line);
+   return hist.line;
+}
+
+// history [n] (built-in)
+int history_builtin(char **args, int num_args) {
+   size_t total, first = 0, off = 0;
+   char *text = NULL;
+   size_t text_cap = 0;
+
+   history_index();
+   total = hist.num + hist.num_added;
+   if (num_args > 1) {
+      long last = atol(args[1]);
+      if (last < 0 || !isdigit((unsigned char)args[1][0])) {
+         fprintf(stderr, "history: %s: not a number\n", args[1]);
+         return 2;
+      }
+      first = (size_t)last < total ? total - last : 0;
+   }
+   for (size_t i = 0; i < total; i++) {
+      const char *s = i < hist.num ? hist.map + off : hist.added[i - hist.num];
+      size_t len = i < hist.num ? history_entry_end(off) - off : strlen(s);
+      off += len + 1; // the index is in text order, walk the file instead
+      if (i < first) {
+         continue;
+      }
+      if (len + 1 > text_cap) {
+         text_cap = 2 * (len + 1);
+         text = realloc(text, text_cap);
+         if (text == NULL) { perror("realloc"); exit(1); }
+      }
+      len = history_decode(s, len, text);
+      printf("%5zu  %.*s\n", i + 1, (int)len, text);
+   }
+   free(text);
+   return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// parsed commands
+////////////////////////////////////////////////////////////////////////
+// A command line is a pipeline of one or more commands (stages) split by
+// '|'. Each stage has its own argv and list of redirections, ready to be
+// launched; everything here lives in the per-command arena.
+//
+// Redirections are applied left to right, like sh, so `> log 2>&1` sends
+// both to log and `2>&1 > log` sends only stdout there. They all happen
+// in the child (or around an in-process built-in), no extra processes.
+////////////////////////////////////////////////////////////////////////
+#define REDIRECT_FD_MAX 9 // fds a redirection may name; the shell's own go above (high_fd)
+
+enum redirect_type { REDIR_IN, REDIR_OUT, REDIR_APPEND, REDIR_DUP, REDIR_CLOSE,
+                     REDIR_HEREDOC, REDIR_HERESTRING };
+
+struct redirect {
+   int type; // enum redirect_type (never REDIR_HERESTRING, that's parse only)
+   int fd; // the fd it changes
+   char *file; // REDIR_IN, REDIR_OUT & REDIR_APPEND; REDIR_HEREDOC: the text
+   int from; // REDIR_DUP: the fd that gets copied to fd; REDIR_APPEND: a
+             // cached fd for the file (-1 if none), see shared redirection fds
+   struct redirect *next;
+};
+
+struct command {
+   char **args; // argv for exec, NULL terminated
+   int num_args; // # of args (args_cap is always > num_args)
+   int args_cap;
+   struct redirect *redirects; // in the order they were given
+   struct redirect **redirects_tail;
+   struct limits *limits; // from pin & limit prefixes, NULL if none
+   struct command *next; // next stage of the pipeline
+};
+
+struct command *command_new(struct arena *a) {
+   struct command *c = arena_alloc(a, sizeof(struct command));
+   c->args_cap = 16; // grows as needed, no fixed limit on # of args
+   c->args = arena_alloc(a, c->args_cap * sizeof(char *));
+   c->args[0] = NULL;
+   c->num_args = 0;
+   c->redirects = NULL;
+   c->redirects_tail = &c->redirects;
+   c->limits = NULL;
+   c->next = NULL;
+   return c;
+}
+
+void command_add_arg(struct arena *a, struct command *c, char *arg) {
+   c->args[c->num_args++] = arg;
+   if (c->num_args == c->args_cap) { // out of slots, double the vector
+      char **bigger = arena_alloc(a, 2 * c->args_cap * sizeof(char *));
+      memcpy(bigger, c->args, c->args_cap * sizeof(char *));
+      c->args = bigger;
+      c->args_cap *= 2;
+   }
+   // last arg must be NULL for exec()!!!!!!!
+   c->args[c->num_args] = NULL;
+}
+
+struct redirect *command_add_redirect(struct arena *a, struct command *c, int type,
+                                      int fd, char *file, int from) {
+   struct redirect *r = arena_alloc(a, sizeof(struct redirect));
+   r->type = type;
+   r->fd = fd;
+   r->file = file;
+   r->from = from;
+   r->next = NULL;
+   *c->redirects_tail = r;
+   c->redirects_tail = &r->next;
+   return r;
+}
+
+// does one of cmd's redirections change fd?
+int command_redirects(const struct command *c, int fd) {
+   for (const struct redirect *r = c->redirects; r != NULL; r = r->next) {
+      if (r->fd == fd) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// open() flags for a redirection to a file
+int redirect_flags(int type) {
+   switch (type) {
+   case REDIR_IN: return O_RDONLY;
+   case REDIR_OUT: return O_WRONLY | O_CREAT | O_TRUNC;
+   default: return O_WRONLY | O_CREAT | O_APPEND;
+   }
+}
+
+// fd moved up out of the way of redirections (which only name 0-9),
+// close-on-exec. Returns the new fd, or -1 with errno set.
+int high_fd(int fd) {
+   int high = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FD_MAX + 1);
+   int err = errno;
+   close(fd);
+   errno = err;
+   return high;
+}
+
+// make the signal pipe (see signal handling), moved up like the rest of
+// the fds the shell keeps. Returns -1 with errno set if it can't.
+int signal_pipe_open(void) {
+   if (pipe2(signal_pipe, O_CLOEXEC | O_NONBLOCK) == -1
+       || (signal_pipe[0] = high_fd(signal_pipe[0])) == -1
+       || (signal_pipe[1] = high_fd(signal_pipe[1])) == -1) {
+      return -1;
+   }
+   return 0;
+}
+
+// a close-on-exec fd (above the ones redirections name, so applying an
+// earlier one can't clobber it) to read a here-doc's text from, or -1
+// with errno set. Up to PIPE_BUF bytes fit in a pipe without blocking; anything
+// bigger goes in a memfd, which is just as anonymous but has no limit.
+int heredoc_fd(const char *text) {
+   size_t len = strlen(text);
+   size_t off = 0;
+   int fds[2];
+   int fd;
+
+   if (len <= PIPE_BUF) {
+      if (pipe2(fds, O_CLOEXEC) == -1) {
+         return -1;
+      }
+      if (len > 0 && write(fds[1], text, len) == -1) {
+         int err = errno;
+         close(fds[0]);
+         close(fds[1]);
+         errno = err;
+         return -1;
+      }
+      close(fds[1]);
+      return high_fd(fds[0]);
+   }
+   fd = memfd_create("smallsh-heredoc", MFD_CLOEXEC);
+   if (fd == -1) {
+      return -1;
+   }
+   while (off < len) {
+      ssize_t n = write(fd, text + off, len - off);
+      if (n == -1 && errno != EINTR) {
+         int err = errno;
+         close(fd);
+         errno = err;
+         return -1;
+      }
+      off += n > 0 ? n : 0;
+   }
+   lseek(fd, 0, SEEK_SET);
+   return high_fd(fd);
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// resource limits & cpu placement
+////////////////////////////////////////////////////////////////////////
+// ulimit (built-in) changes the shell's own limits, so every command
+// started after it gets them too. For one command only there are two
+// prefixes, which can be stacked and go in front of any stage:
+//
+//    pin 0-3,8 cmd        run it on those cpus only
+//    pin node:1 cmd       on the cpus of NUMA node 1, memory from there too
+//    limit mem=2G cpu=60 nofile=1024 cgroup=/sys/fs/cgroup/batch cmd
+//
+// They're words like any other, so `pin $cpu cmd &` in a loop (or
+// `parallel pin {} cmd ::: 0 1 2 3`) spreads a batch out over the cores.
+// The limits are set in the child between fork() and exec(), the spawn
+// attributes have no way to, so a command with a prefix always takes the
+// fork path (see launching). limit's keys are the ulimit ones below by
+// name; sizes are in bytes, with an optional K, M, G or T. cgroup= moves
+// the child into that cgroup v2 directory before anything else.
+//
+// A prefixed command is always exec()d, never run as a built-in.
+////////////////////////////////////////////////////////////////////////
+#define MPOL_BIND 2 // set_mempolicy() mode, from <linux/mempolicy.h>
+
+struct limit_name {
+   const char *name; // limit key
+   char opt; // ulimit option
+   int resource;
+   rlim_t unit; // what a ulimit value counts in
+   const char *what; // for ulimit -a
+};
+
+static const struct limit_name limit_names[] = {
+   { "core", 'c', RLIMIT_CORE, 1024, "core file size (kB)" },
+   { "data", 'd', RLIMIT_DATA, 1024, "data seg size (kB)" },
+   { "fsize", 'f', RLIMIT_FSIZE, 1024, "file size (kB)" },
+   { "nofile", 'n', RLIMIT_NOFILE, 1, "open files" },
+   { "stack", 's', RLIMIT_STACK, 1024, "stack size (kB)" },
+   { "cpu", 't', RLIMIT_CPU, 1, "cpu time (seconds)" },
+   { "nproc", 'u', RLIMIT_NPROC, 1, "max user processes" },
+   { "mem", 'v', RLIMIT_AS, 1024, "virtual memory (kB)" },
+   { NULL, 0, 0, 0, NULL }
+};
+#define LIMITS_MAX (sizeof(limit_names) / sizeof(limit_names[0]) - 1)
+
+struct limits {
+   int resources[LIMITS_MAX]; // setrlimit() these...
+   rlim_t values[LIMITS_MAX]; // ...soft & hard, to these
+   int num;
+   int pinned; // set if cpus says where it can run
+   cpu_set_t cpus;
+   unsigned long nodes; // NUMA nodes to take memory from, 0 for any
+   const char *cgroup; // directory to join, NULL for the shell's
+};
+
+// "unlimited", or a number times unit (a K/M/G/T suffix means bytes
+// instead). 0 if s isn't one.
+int parse_rlim(const char *s, rlim_t unit, rlim_t *value) {
+   char *end;
+   unsigned long long n;
+
+   if (strcmp(s, "unlimited") == 0) {
+      *value = RLIM_INFINITY;
+      return 1;
+   }
+   if (!isdigit((unsigned char)*s)) {
+      return 0;
+   }
+   errno = 0;
+   n = strtoull(s, &end, 10);
+   if (errno != 0) {
+      return 0;
+   }
+   if (*end != '\0') {
+      const char *suffix = strchr("KMGT", toupper((unsigned char)*end));
+      if (suffix == NULL || end[1] != '\0') {
+         return 0;
+      }
+      unit = (rlim_t)1 << (10 * (suffix - "KMGT" + 1));
+   }
+   if (n > RLIM_INFINITY / unit) {
+      return 0;
+   }
+   *value = n * unit;
+   return 1;
+}
+
+// add a cpu list like 0-3,8 to set (ids are < max). 0 if it isn't one.
+int parse_cpu_list(const char *s, cpu_set_t *set, int max) {
+   char *end;
+   long lo, hi;
+
+   do {
+      if (!isdigit((unsigned char)*s)) {
+         return 0;
+      }
+      lo = hi = strtol(s, &end, 10);
+      if (*end == '-') {
+         if (!isdigit((unsigned char)end[1])) {
+            return 0;
+         }
+         hi = strtol(end + 1, &end, 10);
+      }
+      if (lo > hi || hi >= max) {
+         return 0;
+      }
+      for (; lo <= hi; lo++) {
+         CPU_SET(lo, set);
+      }
+      s = end + 1;
+   } while (*end == ',');
+   return *end == '\0' || *end == '\n';
+}
+
+// pin's argument: a cpu list, or node: and a list of NUMA nodes
+int parse_pin(const char *spec, struct limits *lim) {
+   char path[64], list[4096];
+   cpu_set_t nodes;
+
+   if (strncmp(spec, "node:", 5) != 0) {
+      CPU_ZERO(&lim->cpus);
+      return lim->pinned = parse_cpu_list(spec, &lim->cpus, CPU_SETSIZE);
+   }
+   CPU_ZERO(&nodes);
+   if (!parse_cpu_list(spec + 5, &nodes, 8 * sizeof(lim->nodes))) {
+      return 0;
+   }
+   CPU_ZERO(&lim->cpus);
+   lim->nodes = 0;
+   for (int node = 0; node < (int)(8 * sizeof(lim->nodes)); node++) {
+      if (!CPU_ISSET(node, &nodes)) {
+         continue;
+      }
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+      int fd = open(path, O_RDONLY | O_CLOEXEC);
+      ssize_t n = fd == -1 ? -1 : read(fd, list, sizeof(list) - 1);
+      if (fd != -1) {
+         close(fd);
+      }
+      if (n <= 0) {
+         fprintf(stderr, "pin: node %d: no such NUMA node\n", node);
+         return -1;
+      }
+      list[n] = '\0';
+      if (n > 1 && !parse_cpu_list(list, &lim->cpus, CPU_SETSIZE)) {
+         return 0; // n == 1: a node with memory but no cpus
+      }
+      lim->nodes |= 1UL << node;
+   }
+   return lim->pinned = 1;
+}
+
+// one key=value of limit. 0 if it isn't one.
+int parse_limit(const char *arg, struct limits *lim) {
+   const char *eq = strchr(arg, '=');
+   const struct limit_name *l;
+   rlim_t value;
+   int i;
+
+   if (eq == NULL) {
+      return 0;
+   }
+   if (eq - arg == 6 && strncmp(arg, "cgroup", 6) == 0) {
+      lim->cgroup = eq + 1;
+      return eq[1] != '\0';
+   }
+   for (l = limit_names; l->name != NULL; l++) {
+      if (strlen(l->name) == (size_t)(eq - arg) && strncmp(arg, l->name, eq - arg) == 0) {
+         break;
+      }
+   }
+   if (l->name == NULL || !parse_rlim(eq + 1, 1, &value)) {
+      return 0;
+   }
+   for (i = 0; i < lim->num && lim->resources[i] != l->resource; i++) {
+      ; // the same key twice: the last one counts
+   }
+   lim->resources[i] = l->resource;
+   lim->values[i] = value;
+   if (i == lim->num) {
+      lim->num++;
+   }
+   return 1;
+}
+
+// Take any pin/limit prefixes off the front of c's args, into c->limits.
+// Returns 0 (having said why) if one of them is no good.
+int command_prefixes(struct arena *a, struct command *c) {
+   for (;;) {
+      int pin = c->num_args > 0 && strcmp(c->args[0], "pin") == 0;
+      int limit = c->num_args > 0 && strcmp(c->args[0], "limit") == 0;
+      int used = 1;
+      if (!pin && !limit) {
+         return 1;
+      }
+      if (c->limits == NULL) {
+         c->limits = arena_alloc(a, sizeof(struct limits));
+         memset(c->limits, 0, sizeof(struct limits));
+      }
+      if (pin && c->num_args > 2) {
+         int ok = parse_pin(c->args[1], c->limits);
+         if (ok == 0) {
+            fprintf(stderr, "pin: %s: bad cpu list\n", c->args[1]);
+         }
+         if (ok <= 0) {
+            return 0;
+         }
+         used = 2;
+      }
+      while (limit && used < c->num_args - 1 && strchr(c->args[used], '=') != NULL) {
+         if (!parse_limit(c->args[used], c->limits)) {
+            fprintf(stderr, "limit: %s: bad limit\n", c->args[used]);
+            return 0;
+         }
+         used++;
+      }
+      if (used == 1) {
+         fprintf(stderr, pin ? "usage: pin cpus|node:nodes command [args...]\n"
+                             : "usage: limit key=value... command [args...]\n");
+         return 0;
+      }
+      c->args += used;
+      c->num_args -= used;
+      c->args_cap -= used;
+   }
+}
+
+// in the child, before exec(): join the cgroup, bind to the nodes & cpus,
+// set the limits. Returns 0 (having said why) if any of it failed.
+int limits_apply(const struct limits *lim) {
+   char path[PATH_MAX];
+
+   if (lim->cgroup != NULL) {
+      snprintf(path, sizeof(path), "%s/cgroup.procs", lim->cgroup);
+      int fd = open(path, O_WRONLY | O_CLOEXEC);
+      if (fd == -1 || write(fd, "0", 1) != 1) { // 0 is whoever writes it
+         perror(path);
+         return 0;
+      }
+      close(fd);
+   }
+   if (lim->nodes != 0
+       && syscall(SYS_set_mempolicy, MPOL_BIND, &lim->nodes, 8 * sizeof(lim->nodes) + 1) == -1
+       && errno != ENOSYS) { // no NUMA in this kernel, the cpus will do
+      perror("pin");
+      return 0;
+   }
+   if (lim->pinned && sched_setaffinity(0, sizeof(lim->cpus), &lim->cpus) == -1) {
+      perror("pin");
+      return 0;
+   }
+   for (int i = 0; i < lim->num; i++) {
+      struct rlimit rl = { lim->values[i], lim->values[i] };
+      if (setrlimit(lim->resources[i], &rl) == -1) {
+         perror("limit");
+         return 0;
+      }
+   }
+   return 1;
+}
+
+static void print_rlim(rlim_t value, rlim_t unit) {
+   if (value == RLIM_INFINITY) {
+      printf("unlimited\n");
+   }
+   else {
+      printf("%llu\n", (unsigned long long)(value / unit));
+   }
+}
+
+// ulimit [-HS] [-a | -c|-d|-f|-n|-s|-t|-u|-v [value|unlimited]]
+int ulimit_builtin(char **args, int num_args) {
+   const struct limit_name *which = &limit_names[2]; // -f, like sh
+   int hard = 0, soft = 0, all = 0;
+   struct rlimit rl;
+   rlim_t value;
+   int i;
+
+   for (i = 1; i < num_args && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+      for (const char *o = args[i] + 1; *o != '\0'; o++) {
+         const struct limit_name *l = limit_names;
+         while (l->name != NULL && l->opt != *o) {
+            l++;
+         }
+         if (*o == 'H' || *o == 'S' || *o == 'a') {
+            hard |= *o == 'H';
+            soft |= *o == 'S';
+            all |= *o == 'a';
+         }
+         else if (l->name != NULL) {
+            which = l;
+         }
+         else {
+            fprintf(stderr, "ulimit: -%c: invalid option\n", *o);
+            return 2;
+         }
+      }
+   }
+   if (all) {
+      for (const struct limit_name *l = limit_names; l->name != NULL; l++) {
+         getrlimit(l->resource, &rl);
+         printf("%-24s(-%c) ", l->what, l->opt);
+         print_rlim(hard ? rl.rlim_max : rl.rlim_cur, l->unit);
+      }
+      return 0;
+   }
+   getrlimit(which->resource, &rl);
+   if (i == num_args) {
+      print_rlim(hard ? rl.rlim_max : rl.rlim_cur, which->unit);
+      return 0;
+   }
+   if (i + 1 < num_args || !parse_rlim(args[i], which->unit, &value)) {
+      fprintf(stderr, "ulimit: %s: bad limit\n", args[i]);
+      return 2;
+   }
+   if (hard || !soft) { // neither: both, like bash
+      rl.rlim_max = value;
+   }
+   if (soft || !hard) {
+      rl.rlim_cur = value;
+   }
+   if (setrlimit(which->resource, &rl) == -1) {
+      perror("ulimit");
+      return 1;
+   }
+   return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// globbing
+////////////////////////////////////////////////////////////////////////
+// A word with an unquoted *, ? or [...] is a pattern, and turns into the
+// names it matches, sorted; one that matches nothing stays as it is.
+// Like sh, a * or ? never matches a leading '.', and a pattern can have
+// several levels (src/*/*.c). Anything quoted is taken literally, which
+// includes the values of $ expansions; a word with a quoted *, ? or [ of
+// its own isn't a pattern at all.
+//
+// Listings are cached until the next prompt, keyed on the directory's
+// device & inode, and re-read only if its mtime has changed since, so
+// several patterns over one big directory (or one pattern in a loop)
+// cost a stat() each instead of another pass over all of its entries.
+////////////////////////////////////////////////////////////////////////
+struct glob_dir {
+   dev_t dev;
+   ino_t ino;
+   struct timespec mtime; // when it was read
+   char **names; // num of them, pointing into buf
+   unsigned char *types; // d_type of each, DT_UNKNOWN if the fs doesn't say
+   int num;
+   char *buf;
+   struct glob_dir *next;
+};
+
+struct glob_dir *glob_dirs = NULL; // read since the last prompt
+
+void glob_cache_clear(void) {
+   while (glob_dirs != NULL) {
+      struct glob_dir *d = glob_dirs;
+      glob_dirs = d->next;
+      free(d->names);
+      free(d->types);
+      free(d->buf);
+      free(d);
+   }
+}
+
+// (re)read d's entries from path, one pass of readdir(). 0 if it can't.
+static int glob_dir_read(struct glob_dir *d, const char *path) {
+   DIR *dir = opendir(path);
+   struct dirent *ent;
+   size_t len = 0, cap = 4096;
+   size_t *offsets = NULL;
+   int num = 0, num_cap = 0;
+
+   free(d->names);
+   free(d->types);
+   free(d->buf);
+   d->names = NULL;
+   d->types = NULL;
+   d->buf = NULL;
+   d->num = 0;
+   if (dir == NULL) {
+      return 0;
+   }
+   d->buf = malloc(cap);
+   if (d->buf == NULL) { perror("malloc"); exit(1); }
+   while ((ent = readdir(dir)) != NULL) {
+      size_t n = strlen(ent->d_name) + 1;
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+         continue; // never matched, even by .*
+      }
+      if (len + n > cap) {
+         while (len + n > cap) {
+            cap *= 2;
+         }
+         d->buf = realloc(d->buf, cap);
+         if (d->buf == NULL) { perror("realloc"); exit(1); }
+      }
+      if (num == num_cap) {
+         num_cap = num_cap == 0 ? 64 : 2 * num_cap;
+         offsets = realloc(offsets, num_cap * sizeof(size_t));
+         d->types = realloc(d->types, num_cap);
+         if (offsets == NULL || d->types == NULL) { perror("realloc"); exit(1); }
+      }
+      memcpy(d->buf + len, ent->d_name, n);
+      offsets[num] = len;
+      d->types[num] = ent->d_type;
+      num++;
+      len += n;
+   }
+   closedir(dir);
+   // the buffer's done moving, point at the names in it
+   d->names = malloc((num > 0 ? num : 1) * sizeof(char *));
+   if (d->names == NULL) { perror("malloc"); exit(1); }
+   for (int i = 0; i < num; i++) {
+      d->names[i] = d->buf + offsets[i];
+   }
+   d->num = num;
+   free(offsets);
+   return 1;
+}
+
+// the entries of the directory at path, from the cache if it hasn't
+// changed. NULL if it's not a directory we can read.
+struct glob_dir *glob_dir_get(const char *path) {
+   struct stat sb;
+   struct glob_dir *d;
+   if (stat(path, &sb) == -1 || !S_ISDIR(sb.st_mode)) {
+      return NULL;
+   }
+   for (d = glob_dirs; d != NULL; d = d->next) {
+      if (d->dev == sb.st_dev && d->ino == sb.st_ino) {
+         break;
+      }
+   }
+   if (d != NULL && d->mtime.tv_sec == sb.st_mtim.tv_sec
+       && d->mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+      return d;
+   }
+   if (d == NULL) {
+      d = calloc(1, sizeof(struct glob_dir));
+      if (d == NULL) { perror("calloc"); exit(1); }
+      d->dev = sb.st_dev;
+      d->ino = sb.st_ino;
+      d->next = glob_dirs;
+      glob_dirs = d;
+   }
+   d->mtime = sb.st_mtim;
+   return glob_dir_read(d, path) ? d : NULL;
+}
+
+// [...] at p against c. Returns how much of the pattern it takes up and
+// sets *hit, or 0 if there's no closing ] (so the [ is just a '[').
+static size_t glob_class(const char *p, char c, int *hit) {
+   const char *q = p + 1;
+   int negate = 0;
+   int match = 0;
+   if (*q == '!' || *q == '^') {
+      negate = 1;
+      q++;
+   }
+   for (int first = 1; first || *q != ']'; first = 0, q++) { // []...] has a ]
+      unsigned char lo, hi;
+      if (*q == '\0') {
+         return 0;
+      }
+      if (*q == '\\' && q[1] != '\0') {
+         q++;
+      }
+      lo = hi = *q;
+      if (q[1] == '-' && q[2] != ']' && q[2] != '\0') { // a range
+         q += 2;
+         if (*q == '\\' && q[1] != '\0') {
+            q++;
+         }
+         hi = *q;
+      }
+      match |= (unsigned char)c >= lo && (unsigned char)c <= hi;
+   }
+   *hit = match != negate;
+   return q + 1 - p;
+}
+
+// does name match the pattern (one path component)?
+static int glob_match(const char *p, const char *name) {
+   const char *star_p = NULL; // just after the last *
+   const char *star_name = NULL; // where that * has matched up to
+   size_t n;
+   int hit;
+
+   while (*name != '\0') {
+      if (*p == '*') {
+         star_p = ++p;
+         star_name = name;
+         continue;
+      }
+      if (*p == '?') {
+         p++;
+         name++;
+         continue;
+      }
+      if (*p == '[' && (n = glob_class(p, *name, &hit)) > 0) {
+         if (hit) {
+            p += n;
+            name++;
+            continue;
+         }
+      }
+      else {
+         const char *lit = *p == '\\' && p[1] != '\0' ? p + 1 : p;
+         if (*lit != '\0' && *lit == *name) {
+            p = lit + 1;
+            name++;
+            continue;
+         }
+      }
+      if (star_p == NULL) { // no * to stretch
+         return 0;
+      }
+      p = star_p; // let the last * take one more char
+      name = ++star_name;
+   }
+   while (*p == '*') {
+      p++;
+   }
+   return *p == '\0';
+}
+
+// do the first len chars of the pattern have a *, ? or a closed [...]?
+static int glob_has_meta(const char *p, size_t len) {
+   size_t n;
+   int hit;
+   for (size_t i = 0; i < len; i++) {
+      if (p[i] == '\\' && i + 1 < len) {
+         i++;
+      }
+      else if (p[i] == '*' || p[i] == '?') {
+         return 1;
+      }
+      else if (p[i] == '[' && (n = glob_class(p + i, 'a', &hit)) > 0 && n <= len - i) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// Add what matches pat (the rest of the pattern, after the directory
+// already in path[0..len)) to c.
+static void glob_walk(struct arena *a, struct command *c, char *path, size_t len,
+                      const char *pat) {
+   const char *slash = strchr(pat, '/');
+   size_t comp_len = slash != NULL ? (size_t)(slash - pat) : strlen(pat);
+   const char *rest = slash != NULL ? slash + 1 : NULL;
+   size_t i;
+
+   if (!glob_has_meta(pat, comp_len)) { // a plain name, just add it on
+      for (i = 0; i < comp_len && len < PATH_MAX - 2; i++) {
+         if (pat[i] == '\\' && i + 1 < comp_len) {
+            i++;
+         }
+         path[len++] = pat[i];
+      }
+      if (rest != NULL) {
+         path[len++] = '/';
+         path[len] = '\0';
+         glob_walk(a, c, path, len, rest);
+      }
+      else {
+         path[len] = '\0';
+         struct stat sb;
+         if (lstat(path, &sb) == 0) {
+            command_add_arg(a, c, arena_strndup(a, path, len));
+         }
+      }
+      return;
+   }
+
+   char *comp = arena_strndup(a, pat, comp_len);
+   path[len] = '\0';
+   struct glob_dir *d = glob_dir_get(len > 0 ? path : ".");
+   if (d == NULL) {
+      return;
+   }
+   // pick out the matches first, copied: going down a level could re-read
+   // this very listing (through a symlink, say) while we're looping over it
+   char **match = arena_alloc(a, (d->num + 1) * sizeof(char *));
+   unsigned char *type = arena_alloc(a, d->num + 1);
+   int num = 0;
+   for (i = 0; i < (size_t)d->num; i++) {
+      const char *name = d->names[i];
+      if ((name[0] != '.' || comp[0] == '.') && glob_match(comp, name)) {
+         match[num] = rest == NULL ? (char *)name : arena_strndup(a, name, strlen(name));
+         type[num++] = d->types[i];
+      }
+   }
+   for (int m = 0; m < num; m++) {
+      size_t name_len = strlen(match[m]);
+      if (len + name_len + 2 > PATH_MAX) {
+         continue;
+      }
+      memcpy(path + len, match[m], name_len);
+      if (rest == NULL) {
+         command_add_arg(a, c, arena_strndup(a, path, len + name_len));
+      }
+      else if (type[m] == DT_DIR || type[m] == DT_LNK || type[m] == DT_UNKNOWN) {
+         path[len + name_len] = '/';
+         path[len + name_len + 1] = '\0';
+         if (*rest == '\0') { // dir/ : only directories
+            struct stat sb;
+            if (type[m] == DT_DIR || (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode))) {
+               command_add_arg(a, c, arena_strndup(a, path, len + name_len + 1));
+            }
+         }
+         else {
+            glob_walk(a, c, path, len + name_len + 1, rest);
+         }
+      }
+   }
+}
+
+static int glob_cmp(const void *x, const void *y) {
+   return strcmp(*(char *const *)x, *(char *const *)y);
+}
+
+// Add the names pattern matches to c, sorted. Returns 0 (adding nothing)
+// if there aren't any.
+int glob_expand(struct arena *a, struct command *c, const char *pattern) {
+   char path[PATH_MAX];
+   int start = c->num_args;
+   if (!glob_has_meta(pattern, strlen(pattern))) {
+      return 0;
+   }
+   glob_walk(a, c, path, 0, pattern);
+   qsort(c->args + start, c->num_args - start, sizeof(char *), glob_cmp);
+   return c->num_args > start;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// syntax tree
+////////////////////////////////////////////////////////////////////////
+// A command line is parsed once into a small tree. The top is a list of
+// and-or chains split by ';', '&' or newlines. A chain is commands joined
+// by && and || (left to right, no precedence between them), and a command
+// is either a pipeline of stages, each with its words and redirections,
+// or one of
+//
+//    for name in words...; do list; done
+//    while list; do list; done
+//    if list; then list; [elif list; then list;]... [else list;] fi
+//    ( list )
+//
+// whose lists are more of the same (newlines work anywhere a ';' does,
+// and after && and ||; see main() for reading the rest of a multi-line
+// one). Reserved words only count where a command could start, like sh,
+// so `echo done` is fine.
+//
+// A ( list ) runs in a forked copy of the shell, so a cd or exit in it
+// doesn't touch this one. A lone pipeline with & goes to the bgr as is;
+// `&` after anything else (a chain, a for loop) runs it in a bgr subshell.
+//
+// Running a pipeline means expanding its words into plain argv strings
+// (struct command above), in the per-command arena; words without
+// expansions are used as-is, so re-running a cached line (or the body of
+// a loop) costs no tokenizing and no copying.
+////////////////////////////////////////////////////////////////////////
+struct redirect_node {
+   int type; // enum redirect_type
+   int fd;
+   struct word *file; // the file to open (or <<< word), expanded when it runs
+   struct heredoc *heredoc; // REDIR_HEREDOC
+   int from; // REDIR_DUP
+   struct redirect_node *next;
+};
+
+struct stage_node {
+   struct word *words; // command and args
+   int num_words;
+   struct redirect_node *redirects; // in order
+   struct stage_node *next; // next stage of the pipeline
+};
+
+struct pipe_node {
+   struct stage_node *first;
+   int num_stages;
+   int background; // ended with &
+   int timed; // started with `time`
+   char *text; // source text, for the job table
+};
+
+enum node_type { NODE_PIPE, NODE_FOR, NODE_WHILE, NODE_IF, NODE_AND, NODE_OR,
+                 NODE_SUBSHELL };
+
+struct node {
+   int type; // enum node_type
+   struct pipe_node *pipe; // NODE_PIPE
+   char *var; // NODE_FOR: the loop variable
+   struct word *items; // NODE_FOR: words to loop over
+   struct node *cond; // NODE_WHILE, NODE_IF: list whose status decides;
+                      // NODE_AND, NODE_OR: the command on the left
+   struct node *body; // loop body, the `then` list, the command on the
+                      // right of && / ||, or the list in ( )
+   struct node *else_part; // NODE_IF: `else` list, or the `elif` as a NODE_IF
+   int background; // NODE_SUBSHELL: ended with &
+   char *text; // NODE_SUBSHELL: source text, for the job table
+   struct node *next; // next command of the same list
+};
+
+struct parser {
+   struct lexer lex;
+   struct token tok; // current token
+   struct arena *arena;
+   const char *src; // the line before tokenizing
+   const char *error; // first syntax error, NULL if none
+   int incomplete; // input ended inside a for/while/if
+   int depth; // # of ( we're inside
+};
+
+// move on to the next token; cmd if a command could start there
+static void advance(struct parser *ps, int cmd) {
+   if (cmd) {
+      next_command_token(&ps->lex, &ps->tok);
+   }
+   else {
+      next_token(&ps->lex, &ps->tok);
+   }
+}
+
+static int is_word(struct parser *ps, const char *reserved) {
+   struct word *w = ps->tok.word;
+   return ps->tok.type == TOK_WORD && w->parts == NULL && !w->quoted
+          && strcmp(w->text, reserved) == 0;
+}
+
+static int is_reserved(struct parser *ps) {
+   static const char *const reserved[] = {
+      "for", "in", "do", "done", "while", "if", "then", "elif", "else", "fi", NULL
+   };
+   for (int i = 0; reserved[i] != NULL; i++) {
+      if (is_word(ps, reserved[i])) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// record a syntax error about the current token, returns NULL
+static void *parse_error(struct parser *ps) {
+   static const char *const what[] = {
+      [TOK_LT] = "<", [TOK_GT] = ">", [TOK_DGREAT] = ">>", [TOK_LTAND] = "<&",
+      [TOK_GTAND] = ">&", [TOK_DLESS] = "<<", [TOK_DLESSDASH] = "<<-", [TOK_TLESS] = "<<<",
+      [TOK_PIPE] = "|", [TOK_AMP] = "&", [TOK_AND_IF] = "&&", [TOK_OR_IF] = "||",
+      [TOK_LPAREN] = "(", [TOK_RPAREN] = ")",
+      [TOK_SEMI] = ";", [TOK_NEWLINE] = "newline"
+   };
+   char *msg;
+   if (ps->error != NULL) {
+      return NULL;
+   }
+   switch (ps->tok.type) {
+   case TOK_END:
+      ps->error = "unexpected end of input";
+      ps->incomplete = 1;
+      break;
+   case TOK_ERROR:
+      ps->error = "unterminated quote";
+      break;
+   case TOK_WORD:
+      msg = arena_alloc(ps->arena, strlen(ps->tok.word->text) + 16);
+      sprintf(msg, "unexpected `%s'", ps->tok.word->text);
+      ps->error = msg;
+      break;
+   default:
+      msg = arena_alloc(ps->arena, 32);
+      sprintf(msg, "unexpected `%s'", what[ps->tok.type]);
+      ps->error = msg;
+   }
+   return NULL;
+}
+
+static struct node *parse_list(struct parser *ps, const char *const *stop);
+
+static int is_redirect(int type) {
+   return type == TOK_LT || type == TOK_GT || type == TOK_DGREAT || type == TOK_LTAND
+          || type == TOK_GTAND || type == TOK_DLESS || type == TOK_DLESSDASH
+          || type == TOK_TLESS;
+}
+
+// [N]< file, [N]> file, [N]>> file, [N]<&M, [N]>&M, [N]>&-, [N]<<word,
+// [N]<<-word or [N]<<< word at the current token, added to *tail.
+// Returns the next tail, or NULL on a syntax error.
+static struct redirect_node **parse_redirect(struct parser *ps, struct redirect_node **tail) {
+   int type = ps->tok.type;
+   int fd = ps->tok.fd;
+   const char *from;
+   struct redirect_node *r;
+
+   if (fd == -1) {
+      fd = type == TOK_GT || type == TOK_DGREAT || type == TOK_GTAND ? 1 : 0;
+   }
+   advance(ps, 0); // the next token is the file (or fd)
+   if (ps->tok.type != TOK_WORD) {
+      if (ps->tok.type != TOK_ERROR) {
+         ps->error = "missing file name";
+      }
+      return parse_error(ps);
+   }
+   if (fd > REDIRECT_FD_MAX) {
+      ps->error = "bad file descriptor";
+      return NULL;
+   }
+   r = arena_alloc(ps->arena, sizeof(struct redirect_node));
+   r->fd = fd;
+   r->file = NULL;
+   r->heredoc = NULL;
+   r->from = -1;
+   r->next = NULL;
+   if (type == TOK_DLESS || type == TOK_DLESSDASH) { // body comes after the line
+      struct heredoc *h = arena_alloc(ps->arena, sizeof(struct heredoc));
+      if (ps->tok.word->parts != NULL) {
+         ps->error = "bad here-document delimiter";
+         return NULL;
+      }
+      h->delim = ps->tok.word->text;
+      h->expand = !ps->tok.word->quoted;
+      h->strip_tabs = type == TOK_DLESSDASH;
+      h->body = NULL;
+      h->next = NULL;
+      *ps->lex.heredocs_tail = h;
+      ps->lex.heredocs_tail = &h->next;
+      r->type = REDIR_HEREDOC;
+      r->heredoc = h;
+   }
+   else if (type == TOK_TLESS) {
+      r->type = REDIR_HERESTRING;
+      r->file = ps->tok.word;
+   }
+   else if (type == TOK_LTAND || type == TOK_GTAND) {
+      from = ps->tok.word->text;
+      if (ps->tok.word->parts == NULL && strcmp(from, "-") == 0) {
+         r->type = REDIR_CLOSE;
+      }
+      else if (ps->tok.word->parts == NULL && from[0] >= '0' && from[0] <= '9'
+               && from[1] == '\0') {
+         r->type = REDIR_DUP;
+         r->from = from[0] - '0';
+      }
+      else {
+         ps->error = "bad file descriptor";
+         return NULL;
+      }
+   }
+   else {
+      r->type = type == TOK_LT ? REDIR_IN : type == TOK_GT ? REDIR_OUT : REDIR_APPEND;
+      r->file = ps->tok.word;
+   }
+   *tail = r;
+   return &r->next;
+}
+
+// time [command] [redirections] [| command ...], the & (if any) is
+// left for parse_list()
+static struct pipe_node *parse_pipeline(struct parser *ps) {
+   struct arena *a = ps->arena;
+   struct word **words_tail; // where the next word of the stage goes
+   struct redirect_node **redirects_tail; // and its next redirection
+   size_t start = ps->lex.start;
+   size_t end;
+   int type;
+
+   struct pipe_node *p = arena_alloc(a, sizeof(struct pipe_node));
+   struct stage_node *stage = arena_alloc(a, sizeof(struct stage_node));
+   memset(p, 0, sizeof(struct pipe_node));
+   memset(stage, 0, sizeof(struct stage_node));
+   p->first = stage;
+   p->num_stages = 1;
+   words_tail = &stage->words;
+   redirects_tail = &stage->redirects;
+
+   // time [command]: report how long the rest of the pipeline took
+   if (is_word(ps, "time")) {
+      p->timed = 1;
+      advance(ps, 0);
+   }
+
+   // tokenize the rest of the command...
+   for (type = ps->tok.type; ; type = ps->tok.type) {
+      if (is_redirect(type)) { // input or output file?
+         redirects_tail = parse_redirect(ps, redirects_tail);
+         if (redirects_tail == NULL) {
+            return NULL;
+         }
+      }
+      else if (type == TOK_PIPE) { // pipe into the next command
+         if (stage->num_words == 0) {
+            return parse_error(ps);
+         }
+         stage->next = arena_alloc(a, sizeof(struct stage_node));
+         stage = stage->next;
+         memset(stage, 0, sizeof(struct stage_node));
+         words_tail = &stage->words;
+         redirects_tail = &stage->redirects;
+         p->num_stages++;
+      }
+      else if (type == TOK_WORD) { // everything else is considered an argument!
+         *words_tail = ps->tok.word;
+         words_tail = &ps->tok.word->next;
+         stage->num_words++;
+      }
+      else {
+         break; // end of the pipeline (or a bad token)
+      }
+      advance(ps, 0);
+   }
+   if (type == TOK_ERROR) {
+      return parse_error(ps);
+   }
+   if (p->num_stages > 1 && stage->num_words == 0) {
+      ps->error = "unexpected `|'"; // `cmd |`
+      return NULL;
+   }
+   if (stage->num_words == 0 && !p->timed && stage->redirects == NULL) {
+      return parse_error(ps); // e.g. a `;` or `&&` with no command in front of it
+   }
+   // what the job table shows for it, no trailing blanks (parse_list()
+   // adds the & if there is one)
+   end = ps->lex.start;
+   while (end > start && is_blank(ps->src[end - 1])) {
+      end--;
+   }
+   p->text = arena_strndup(a, ps->src + start, end - start);
+   return p;
+}
+
+// after `for`: name in words...; do list; done
+static struct node *parse_for(struct parser *ps, struct node *n) {
+   static const char *const done[] = { "done", NULL };
+   struct word **items_tail = &n->items;
+   const char *v;
+
+   advance(ps, 0);
+   if (ps->tok.type != TOK_WORD || ps->tok.word->parts != NULL || ps->tok.word->quoted) {
+      return parse_error(ps);
+   }
+   for (v = ps->tok.word->text; is_name_char(*v, v == ps->tok.word->text); v++) {
+      ;
+   }
+   if (*v != '\0' || v == ps->tok.word->text) {
+      ps->error = "bad for loop variable";
+      return NULL;
+   }
+   n->var = ps->tok.word->text;
+   advance(ps, 0);
+   if (!is_word(ps, "in")) {
+      return parse_error(ps);
+   }
+   for (advance(ps, 0); ps->tok.type == TOK_WORD; advance(ps, 0)) {
+      *items_tail = ps->tok.word;
+      items_tail = &ps->tok.word->next;
+   }
+   if (ps->tok.type != TOK_SEMI && ps->tok.type != TOK_NEWLINE) {
+      return parse_error(ps);
+   }
+   do {
+      advance(ps, 1);
+   } while (ps->tok.type == TOK_NEWLINE);
+   if (!is_word(ps, "do")) {
+      return parse_error(ps);
+   }
+   advance(ps, 1);
+   n->body = parse_list(ps, done);
+   if (n->body == NULL) {
+      return parse_error(ps);
+   }
+   advance(ps, 1);
+   return n;
+}
+
+// after `while`: list; do list; done
+static struct node *parse_while(struct parser *ps, struct node *n) {
+   static const char *const do_[] = { "do", NULL };
+   static const char *const done[] = { "done", NULL };
+   advance(ps, 1);
+   n->cond = parse_list(ps, do_);
+   if (n->cond == NULL) {
+      return parse_error(ps);
+   }
+   advance(ps, 1);
+   n->body = parse_list(ps, done);
+   if (n->body == NULL) {
+      return parse_error(ps);
+   }
+   advance(ps, 1);
+   return n;
+}
+
+// after `if` or `elif`: list; then list; [elif ...] [else list;] fi
+static struct node *parse_if(struct parser *ps, struct node *n) {
+   static const char *const then[] = { "then", NULL };
+   static const char *const rest[] = { "elif", "else", "fi", NULL };
+   static const char *const fi[] = { "fi", NULL };
+   advance(ps, 1);
+   n->cond = parse_list(ps, then);
+   if (n->cond == NULL) {
+      return parse_error(ps);
+   }
+   advance(ps, 1);
+   n->body = parse_list(ps, rest);
+   if (n->body == NULL) {
+      return parse_error(ps);
+   }
+   if (is_word(ps, "elif")) { // the rest is an if of its own, it eats the fi
+      n->else_part = arena_alloc(ps->arena, sizeof(struct node));
+      memset(n->else_part, 0, sizeof(struct node));
+      n->else_part->type = NODE_IF;
+      return parse_if(ps, n->else_part) != NULL ? n : NULL;
+   }
+   if (is_word(ps, "else")) {
+      advance(ps, 1);
+      n->else_part = parse_list(ps, fi);
+      if (n->else_part == NULL) {
+         return parse_error(ps);
+      }
+   }
+   advance(ps, 1);
+   return n;
+}
+
+// after `(`: list )
+static struct node *parse_subshell(struct parser *ps, struct node *n) {
+   size_t start = ps->lex.start;
+   advance(ps, 1);
+   ps->depth++;
+   n->body = parse_list(ps, NULL);
+   ps->depth--;
+   if (n->body == NULL || ps->tok.type != TOK_RPAREN) {
+      return parse_error(ps);
+   }
+   n->text = arena_strndup(ps->arena, ps->src + start, ps->lex.pos - start);
+   advance(ps, 0);
+   return n;
+}
+
+// one command of a chain: a pipeline, for/while/if or ( list )
+static struct node *parse_command(struct parser *ps) {
+   struct node *n = arena_alloc(ps->arena, sizeof(struct node));
+   memset(n, 0, sizeof(struct node));
+   if (is_word(ps, "for") || is_word(ps, "while") || is_word(ps, "if")
+       || ps->tok.type == TOK_LPAREN) {
+      if (ps->tok.type == TOK_LPAREN) {
+         n->type = NODE_SUBSHELL;
+      }
+      else {
+         n->type = is_word(ps, "for") ? NODE_FOR : is_word(ps, "while") ? NODE_WHILE : NODE_IF;
+      }
+      if ((n->type == NODE_FOR ? parse_for(ps, n) : n->type == NODE_WHILE ?
+           parse_while(ps, n) : n->type == NODE_IF ? parse_if(ps, n)
+           : parse_subshell(ps, n)) == NULL) {
+         return NULL;
+      }
+      // done/fi/) must end the command, no | or redirections after it
+      switch (ps->tok.type) {
+      case TOK_SEMI: case TOK_AMP: case TOK_AND_IF: case TOK_OR_IF: case TOK_RPAREN:
+      case TOK_NEWLINE: case TOK_END:
+         return n;
+      default:
+         return is_reserved(ps) ? n : parse_error(ps);
+      }
+   }
+   if (is_reserved(ps)) { // a `done` or `fi` with nothing open
+      return parse_error(ps);
+   }
+   n->type = NODE_PIPE;
+   n->pipe = parse_pipeline(ps);
+   return n->pipe != NULL ? n : NULL;
+}
+
+// command [&& command | || command]...
+static struct node *parse_and_or(struct parser *ps) {
+   struct node *left = parse_command(ps);
+   while (left != NULL && (ps->tok.type == TOK_AND_IF || ps->tok.type == TOK_OR_IF)) {
+      struct node *n = arena_alloc(ps->arena, sizeof(struct node));
+      memset(n, 0, sizeof(struct node));
+      n->type = ps->tok.type == TOK_AND_IF ? NODE_AND : NODE_OR;
+      n->cond = left;
+      do {
+         advance(ps, 1);
+      } while (ps->tok.type == TOK_NEWLINE);
+      if (ps->tok.type == TOK_END) {
+         return parse_error(ps); // needs the next line
+      }
+      n->body = parse_command(ps);
+      left = n->body != NULL ? n : NULL;
+   }
+   return left;
+}
+
+// chains up to one of the reserved words in stop (left as the current
+// token), or to the end of input (or the `)` of the ( we're in) if stop
+// is NULL. NULL if there were none.
+static struct node *parse_list(struct parser *ps, const char *const *stop) {
+   struct node *first = NULL;
+   struct node **tail = &first;
+   for (;;) {
+      while (ps->tok.type == TOK_NEWLINE) {
+         advance(ps, 1);
+      }
+      if (ps->tok.type == TOK_END) { // fine unless something's still open
+         return stop == NULL && ps->depth == 0 ? first : parse_error(ps);
+      }
+      if (ps->tok.type == TOK_RPAREN && stop == NULL && ps->depth > 0) {
+         return first;
+      }
+      for (int i = 0; stop != NULL && stop[i] != NULL; i++) {
+         if (is_word(ps, stop[i])) {
+            return first;
+         }
+      }
+      size_t start = ps->lex.start;
+      struct node *n = parse_and_or(ps);
+      if (n == NULL) {
+         return NULL;
+      }
+      if (ps->tok.type == TOK_AMP) { // should this be run in the bgr?
+         char *text = arena_strndup(ps->arena, ps->src + start, ps->lex.pos - start);
+         if (n->type == NODE_PIPE) {
+            n->pipe->background = 1;
+            n->pipe->text = text;
+         }
+         else if (n->type == NODE_SUBSHELL) {
+            n->background = 1;
+            n->text = text;
+         }
+         else { // a chain or a loop: in a subshell of its own
+            struct node *sub = arena_alloc(ps->arena, sizeof(struct node));
+            memset(sub, 0, sizeof(struct node));
+            sub->type = NODE_SUBSHELL;
+            sub->body = n;
+            sub->background = 1;
+            sub->text = text;
+            n = sub;
+         }
+         advance(ps, 1);
+      }
+      else if (ps->tok.type == TOK_SEMI) {
+         advance(ps, 1);
+      }
+      else if (ps->tok.type != TOK_NEWLINE && ps->tok.type != TOK_END
+               && ps->tok.type != TOK_RPAREN && ps->tok.type != TOK_WORD) {
+         return parse_error(ps);
+      }
+      *tail = n;
+      tail = &n->next;
+   }
+}
+
+// Parse a line (in place; src is an untouched copy of it) into a tree
+// allocated from a. Comments and blank lines give NULL, so does a syntax
+// error, which also sets *error. *incomplete is set if the line is the
+// start of a for/while/if that needs more lines.
+struct node *parse_line(struct arena *a, char *line, const char *src,
+                        const char **error, int *incomplete) {
+   struct parser ps;
+   struct node *list;
+
+   lexer_init(&ps.lex, line, a);
+   ps.arena = a;
+   ps.src = src;
+   ps.error = NULL;
+   ps.incomplete = 0;
+   ps.depth = 0;
+   advance(&ps, 1); // get command or comment
+   list = parse_list(&ps, NULL);
+   if (ps.lex.heredoc_missing) { // whatever else went wrong, it needs more lines
+      ps.error = "unterminated here-document";
+      ps.incomplete = 1;
+   }
+   *error = ps.error;
+   *incomplete = ps.incomplete;
+   return ps.error == NULL ? list : NULL;
+}
+
+// text a part stands for; num is scratch space for $$, $?, $! & $#
+static const char *part_value(const struct word_part *part, char *num, size_t *len) {
+   const char *value;
+   switch (part->type) {
+   case PART_PID:
+      *len = sprintf(num, "%d", (int)shell_pid);
+      return num;
+   case PART_STATUS:
+      *len = sprintf(num, "%d", last_status);
+      return num;
+   case PART_LAST_BG:
+      *len = last_bg_pid != -1 ? sprintf(num, "%d", (int)last_bg_pid) : 0;
+      return num;
+   case PART_NUM_ARGS:
+      *len = sprintf(num, "%d", num_script_args > 1 ? num_script_args - 1 : 0);
+      return num;
+   case PART_VAR:
+      value = var_get(part->text, part->len);
+      value = value != NULL ? value : "";
+      *len = strlen(value);
+      return value;
+   case PART_ARG:
+      value = part->len < (size_t)num_script_args ? script_args[part->len] : "";
+      *len = strlen(value);
+      return value;
+   default:
+      *len = part->len;
+      return part->text;
+   }
+}
+
+// evaluate a word's expansions, into the arena (plain words cost nothing)
+char *expand_word(struct arena *a, struct word *w) {
+   struct word_part *part;
+   char num[16];
+   size_t len = 0;
+   size_t n;
+
+   if (w->parts == NULL) {
+      return w->text;
+   }
+   for (part = w->parts; part != NULL; part = part->next) { // measure
+      part_value(part, num, &n);
+      len += n;
+   }
+   char *out = arena_alloc(a, len + 1);
+   char *o = out;
+   for (part = w->parts; part != NULL; part = part->next) { // fill in
+      const char *value = part_value(part, num, &n);
+      memcpy(o, value, n);
+      o += n;
+   }
+   *o = '\0';
+   return out;
+}
+
+// a pattern word with its expansions filled in, escaped so a * in a value
+// is just a '*' (see globbing)
+static char *glob_pattern(struct arena *a, struct word *w) {
+   struct word_part *part;
+   char num[16];
+   size_t len = 0;
+   size_t n;
+
+   if (w->parts == NULL) {
+      return w->text; // quoted * ? [ (or \) would have made it no pattern
+   }
+   for (part = w->parts; part != NULL; part = part->next) { // measure
+      part_value(part, num, &n);
+      len += part->type == PART_TEXT ? n : 2 * n;
+   }
+   char *out = arena_alloc(a, len + 1);
+   char *o = out;
+   for (part = w->parts; part != NULL; part = part->next) { // fill in
+      const char *value = part_value(part, num, &n);
+      for (size_t i = 0; i < n; i++) {
+         if (part->type != PART_TEXT && is_glob_char(value[i])) {
+            *o++ = '\\';
+         }
+         *o++ = value[i];
+      }
+   }
+   *o = '\0';
+   return out;
+}
+
+// Expand a word into args of c. Like sh, an unquoted $name is split into
+// several args at blanks, and one that's empty disappears altogether. A
+// pattern turns into the names it matches (which aren't split, and nor
+// are $names in it).
+void expand_fields(struct arena *a, struct word *w, struct command *c) {
+   struct word_part *part;
+   char num[16];
+   size_t len = 0;
+   size_t n;
+   int split = 0;
+
+   if (w->glob) {
+      if (!glob_expand(a, c, glob_pattern(a, w))) {
+         command_add_arg(a, c, expand_word(a, w)); // no match, leave it be
+      }
+      return;
+   }
+
+   for (part = w->parts; part != NULL; part = part->next) {
+      split |= (part->type == PART_VAR || part->type == PART_ARG) && !part->quoted;
+   }
+   if (!split) {
+      command_add_arg(a, c, expand_word(a, w));
+      return;
+   }
+   for (part = w->parts; part != NULL; part = part->next) { // measure
+      part_value(part, num, &n);
+      len += n;
+   }
+   // the fields go end to end in one buffer, each blank that splits them
+   // making room for a field's '\0'
+   char *field = arena_alloc(a, len + 1);
+   char *o = field;
+   int started = 0; // the current field has something in it (maybe "")
+   for (part = w->parts; part != NULL; part = part->next) {
+      const char *value = part_value(part, num, &n);
+      if ((part->type != PART_VAR && part->type != PART_ARG) || part->quoted) {
+         memcpy(o, value, n);
+         o += n;
+         started = 1;
+         continue;
+      }
+      for (size_t i = 0; i < n; i++) {
+         if (value[i] == ' ' || value[i] == '\t' || value[i] == '\n') {
+            if (started) {
+               *o++ = '\0';
+               command_add_arg(a, c, field);
+               field = o;
+               started = 0;
+            }
+         }
+         else {
+            *o++ = value[i];
+            started = 1;
+         }
+      }
+   }
+   if (started) {
+      *o = '\0';
+      command_add_arg(a, c, field);
+   }
+}
+
+// turn a parsed pipeline into commands ready to launch
+struct command *expand_pipeline(struct arena *a, struct pipe_node *p) {
+   struct command *first = NULL;
+   struct command **tail = &first;
+   for (struct stage_node *s = p->first; s != NULL; s = s->next) {
+      struct command *cmd = command_new(a);
+      for (struct word *w = s->words; w != NULL; w = w->next) {
+         expand_fields(a, w, cmd);
+      }
+      if (!command_prefixes(a, cmd)) {
+         return NULL;
+      }
+      for (struct redirect_node *r = s->redirects; r != NULL; r = r->next) {
+         if (r->type == REDIR_HEREDOC) {
+            command_add_redirect(a, cmd, REDIR_HEREDOC, r->fd,
+                                 expand_word(a, r->heredoc->body), -1);
+         }
+         else if (r->type == REDIR_HERESTRING) { // the word and a newline
+            char *word = expand_word(a, r->file);
+            size_t len = strlen(word);
+            char *text = arena_alloc(a, len + 2);
+            memcpy(text, word, len);
+            strcpy(text + len, "\n");
+            command_add_redirect(a, cmd, REDIR_HEREDOC, r->fd, text, -1);
+         }
+         else {
+            command_add_redirect(a, cmd, r->type, r->fd,
+                                 r->file != NULL ? expand_word(a, r->file) : NULL, r->from);
+         }
+      }
+      *tail = cmd;
+      tail = &cmd->next;
+   }
+   return first;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// parse cache
+////////////////////////////////////////////////////////////////////////
+// Parsed lines are kept in a direct-mapped cache keyed by the line's
+// text, so a line that comes around again (a loop in a generated script,
+// the same command typed twice) skips the tokenizer and parser entirely.
+// Each slot owns an arena holding a copy of the line, the tokenized copy
+// the tree points into, and the tree itself; a colliding line just resets
+// the slot's arena and reuses its memory.
+//
+// A multi-line for/while/if is cached as one entry, keyed by all of its
+// lines. Until it's closed, each new line re-parses the lines before it;
+// that's quadratic in the length of the construct, but only the first
+// time through, a loop in a script runs from the cache after that.
+//
+// Note: a tree is only valid until the next parse_cached() call, which
+// is fine as long as a line is done running before the next one is read.
+////////////////////////////////////////////////////////////////////////
+#define PARSE_CACHE_SLOTS 256 // power of 2
+
+struct parse_entry {
+   unsigned hash; // hash_string() of text
+   char *text; // the line as read, NULL if the slot is unused
+   struct node *tree; // NULL for blank lines, comments & errors
+   const char *error; // syntax error, if any
+   int incomplete; // an unclosed for/while/if, needs more lines
+   struct arena arena; // everything above lives here
+};
+
+struct parse_entry parse_cache[PARSE_CACHE_SLOTS];
+
+struct parse_entry *parse_cached(const char *line) {
+   unsigned hash = hash_string(line);
+   struct parse_entry *e = &parse_cache[hash & (PARSE_CACHE_SLOTS - 1)];
+   TRACE_START(parse_start);
+
+   if (e->text != NULL && e->hash == hash && strcmp(e->text, line) == 0) {
+      TRACE_END(parse_start, TRACE_PARSE, 1);
+      return e; // hit
+   }
+   if (e->text == NULL) { // first use of this slot
+      arena_init(&e->arena, 1024);
+   }
+   else {
+      arena_reset(&e->arena);
+   }
+   e->hash = hash;
+   e->text = arena_strdup(&e->arena, line);
+   e->tree = parse_line(&e->arena, arena_strdup(&e->arena, line), e->text,
+                        &e->error, &e->incomplete);
+   TRACE_END(parse_start, TRACE_PARSE, 0);
+   return e;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// shared redirection fds
+////////////////////////////////////////////////////////////////////////
+// /dev/null is opened once, when the shell starts, and background
+// commands get that fd dup2'd onto their stdin & stdout instead of each
+// opening it again.
+//
+// >> files are kept open for the rest of the command line, so a loop
+// that appends to the same log every time around (for ...; do cmd >> log;
+// done) opens it once. That's only right for >>, whose writes all go to
+// the end of the file whatever the offset; a shared < or > fd would share
+// (or fail to reset) the offset. The cache is dropped when the line is
+// done (see main()) and by cd, which can change what a relative name
+// means; a loop that renames or removes the file itself would keep
+// appending to the old one until then.
+//
+// All of these live above fd REDIRECT_FD_MAX, close-on-exec, so the
+// children only get the dup2'd copies.
+////////////////////////////////////////////////////////////////////////
+#define APPEND_CACHE_SIZE 8
+
+int devnull_fd = -1; // O_RDWR, for bgr commands & parallel
+
+struct append_entry {
+   char *path;
+   int fd;
+};
+
+struct append_entry append_cache[APPEND_CACHE_SIZE];
+int append_cache_size = 0;
+
+void devnull_open(void) {
+   int fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+   if (fd == -1 || (devnull_fd = high_fd(fd)) == -1) {
+      perror("/dev/null");
+      exit(1);
+   }
+}
+
+// a cached fd appending to path, opening it if it's new. -1 if the cache
+// is full or it can't be opened: open it the usual way (and report that).
+int append_fd(const char *path) {
+   int i, fd;
+   for (i = 0; i < append_cache_size; i++) {
+      if (strcmp(append_cache[i].path, path) == 0) {
+         return append_cache[i].fd;
+      }
+   }
+   if (append_cache_size == APPEND_CACHE_SIZE) {
+      return -1;
+   }
+   fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+   if (fd == -1 || (fd = high_fd(fd)) == -1) {
+      return -1;
+   }
+   append_cache[append_cache_size].path = strdup(path);
+   append_cache[append_cache_size].fd = fd;
+   append_cache_size++;
+   return fd;
+}
+
+void append_cache_clear(void) {
+   for (int i = 0; i < append_cache_size; i++) {
+      close(append_cache[i].fd);
+      free(append_cache[i].path);
+   }
+   append_cache_size = 0;
+}
+
+// look up the cached fds for cmd's >> files, before it's launched
+void cache_appends(struct command *cmd) {
+   for (struct redirect *r = cmd->redirects; r != NULL; r = r->next) {
+      if (r->type == REDIR_APPEND) {
+         r->from = append_fd(r->file);
+      }
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// launching external commands
+////////////////////////////////////////////////////////////////////////
+// Commands are started with posix_spawn(), which glibc implements with
+// clone(CLONE_VM | CLONE_VFORK): the child borrows the shell's memory
+// until it execs, so no page tables get copied and launch latency stays
+// flat no matter how big the shell grows. The executable comes from the
+// path cache above, so a repeat launch is a single execve. Pipe ends, the
+// /dev/null defaults for background commands and then the redirections,
+// in order, become spawn file actions (dup2s of the shared fds above where
+// there is one), and the spawn attributes set the
+// process group and put SIGINT, SIGTSTP, SIGTTIN & SIGTTOU back to their
+// default dispositions in the child. Under job control the first process
+// of a foreground job also takes the terminal before it execs (glibc
+// 2.35+), so it can't be stopped reading it before the shell hands it over.
+//
+// Builds without posix_spawn (or compiled with -DSMALLSH_USE_FORK) fall
+// back to the classic fork() + dup2() + execvp() path, and so does a
+// command with a pin or limit prefix.
+////////////////////////////////////////////////////////////////////////
+#if !defined(SMALLSH_USE_FORK) && defined(_POSIX_SPAWN) && _POSIX_SPAWN > 0
+#define HAVE_POSIX_SPAWN 1
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define HAVE_SPAWN_TCSETPGRP 1
+#endif
+#endif
+
+int job_control = 0; // interactive: jobs get process groups & the terminal
+
+// everything launch_command() needs to know about one process
+struct launch {
+   struct command *cmd;
+   int pipe_in; // fd to use as stdin, -1 if none
+   int pipe_out; // fd to use as stdout, -1 if none
+   int background; // bgr commands default to /dev/null for stdin/stdout
+   pid_t pgid; // -1 stay in the shell's group, 0 lead a new one, >0 join
+   int take_tty; // a new foreground group under job control: give it the tty
+};
+
+// Returns the child's pid, or -1 with errno set if it couldn't be started.
+// The classic way, and the only one that can run code in the child.
+pid_t fork_command(const struct launch *l) {
+   struct command *cmd = l->cmd;
+   int fd;
+   TRACE_START(lookup_start);
+   const char *path = path_lookup(cmd->args[0], 1);
+   TRACE_END(lookup_start, TRACE_LOOKUP, 0);
+   pid_t pid;
+
+   if (path == NULL) { // not on $PATH, don't bother forking
+      return -1;
+   }
+   cache_appends(cmd); // in the parent, so the next command gets them too
+   TRACE_START(spawn_start);
+   pid = fork();
+
+   if (pid != 0) { // parent (or fork error)
+      if (pid > 0 && l->pgid != -1) { // both sides setpgid, no race
+         setpgid(pid, l->pgid);
+      }
+      TRACE_END(spawn_start, TRACE_SPAWN, pid);
+      return pid;
+   }
+   // in child...
+   if (l->pgid != -1) {
+      setpgid(0, l->pgid);
+   }
+   if (l->take_tty && l->pgid == 0) { // SIGTTOU is still ignored here
+      tcsetpgrp(STDIN_FILENO, getpid());
+   }
+   signal(SIGINT, SIG_DFL);
+   signal(SIGTSTP, SIG_DFL);
+   signal(SIGTTIN, SIG_DFL);
+   signal(SIGTTOU, SIG_DFL);
+   signal(SIGPIPE, SIG_DFL);
+   if (cmd->limits != NULL && !limits_apply(cmd->limits)) {
+      _exit(126);
+   }
+   if (l->pipe_in != -1 && dup2(l->pipe_in, 0) == -1) { perror("dup2"); _exit(2); }
+   if (l->pipe_out != -1 && dup2(l->pipe_out, 1) == -1) { perror("dup2"); _exit(2); }
+   // bgr commands default to /dev/null for stdin & stdout
+   if (l->background && l->pipe_in == -1 && !command_redirects(cmd, 0)
+       && dup2(devnull_fd, 0) == -1) { perror("dup2"); _exit(2); }
+   if (l->background && l->pipe_out == -1 && !command_redirects(cmd, 1)
+       && dup2(devnull_fd, 1) == -1) { perror("dup2"); _exit(2); }
+   // then the redirections, in order
+   for (struct redirect *r = cmd->redirects; r != NULL; r = r->next) {
+      if (r->type == REDIR_DUP || (r->type == REDIR_APPEND && r->from != -1)) {
+         if (dup2(r->from, r->fd) == -1) { perror("dup2"); _exit(2); }
+      }
+      else if (r->type == REDIR_CLOSE) {
+         close(r->fd);
+      }
+      else if (r->type == REDIR_HEREDOC) {
+         fd = heredoc_fd(r->file);
+         if (fd == -1 || dup2(fd, r->fd) == -1) { perror("here-document"); _exit(1); }
+         close(fd);
+      }
+      else {
+         fd = open(r->file, redirect_flags(r->type), 0644);
+         if (fd == -1) { perror("open()"); _exit(1); }
+         if (fd != r->fd) {
+            if (dup2(fd, r->fd) == -1) { perror("dup2"); _exit(2); }
+            close(fd);
+         }
+      }
+   }
+   execv(path, cmd->args);
+   if (errno == ENOENT) { // stale cache entry, let execvp search $PATH
+      execvp(cmd->args[0], cmd->args);
+   }
+   // if it returns, there was an error
+   perror("incorrect command");
+   _exit(1);
+}
+
+#ifdef HAVE_POSIX_SPAWN
+// the child has its copies of the here-doc fds (or never will)
+static void close_heredocs(struct command *cmd) {
+   for (struct redirect *r = cmd->redirects; r != NULL; r = r->next) {
+      if (r->type == REDIR_HEREDOC && r->from != -1) {
+         close(r->from);
+         r->from = -1;
+      }
+   }
+}
+
+pid_t launch_command(const struct launch *l) {
+   struct command *cmd = l->cmd;
+   posix_spawn_file_actions_t actions;
+   posix_spawnattr_t attr;
+   sigset_t sigdefault, sigmask;
+   short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+   pid_t pid;
+   int err;
+
+   if (cmd->limits != NULL) { // spawn attributes can't do limits or cpus
+      return fork_command(l);
+   }
+   // here-docs are read from fds the shell fills in first; from holds them
+   cache_appends(cmd);
+   for (struct redirect *r = cmd->redirects; r != NULL; r = r->next) {
+      if (r->type == REDIR_HEREDOC && (r->from = heredoc_fd(r->file)) == -1) {
+         err = errno;
+         close_heredocs(cmd);
+         errno = err;
+         return -1;
+      }
+   }
+
+   posix_spawn_file_actions_init(&actions);
+#ifdef HAVE_SPAWN_TCSETPGRP
+   if (l->take_tty && l->pgid == 0) {
+      posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+   }
+#endif
+   // hook up the pipes first, so a redirection on the same stage wins.
+   // the pipe fds are close-on-exec, only the dup2'd copies survive.
+   if (l->pipe_in != -1) {
+      posix_spawn_file_actions_adddup2(&actions, l->pipe_in, 0);
+   }
+   if (l->pipe_out != -1) {
+      posix_spawn_file_actions_adddup2(&actions, l->pipe_out, 1);
+   }
+   // bgr commands default to /dev/null for stdin & stdout
+   if (l->background && l->pipe_in == -1 && !command_redirects(cmd, 0)) {
+      posix_spawn_file_actions_adddup2(&actions, devnull_fd, 0);
+   }
+   if (l->background && l->pipe_out == -1 && !command_redirects(cmd, 1)) {
+      posix_spawn_file_actions_adddup2(&actions, devnull_fd, 1);
+   }
+   for (struct redirect *r = cmd->redirects; r != NULL; r = r->next) {
+      if (r->type == REDIR_DUP || r->type == REDIR_HEREDOC
+          || (r->type == REDIR_APPEND && r->from != -1)) {
+         posix_spawn_file_actions_adddup2(&actions, r->from, r->fd);
+      }
+      else if (r->type == REDIR_CLOSE) {
+         posix_spawn_file_actions_addclose(&actions, r->fd);
+      }
+      else {
+         posix_spawn_file_actions_addopen(&actions, r->fd, r->file,
+                                          redirect_flags(r->type), 0644);
+      }
+   }
+
+   // the child gets default SIGINT/SIGTSTP/SIGTTIN/SIGTTOU/SIGPIPE
+   // handling and an empty mask
+   posix_spawnattr_init(&attr);
+   sigemptyset(&sigdefault);
+   sigaddset(&sigdefault, SIGINT);
+   sigaddset(&sigdefault, SIGTSTP);
+   sigaddset(&sigdefault, SIGTTIN);
+   sigaddset(&sigdefault, SIGTTOU);
+   sigaddset(&sigdefault, SIGPIPE); // the command server ignores it
+   sigemptyset(&sigmask);
+   posix_spawnattr_setsigdefault(&attr, &sigdefault);
+   posix_spawnattr_setsigmask(&attr, &sigmask);
+   if (l->pgid != -1) {
+      posix_spawnattr_setpgroup(&attr, l->pgid);
+      flags |= POSIX_SPAWN_SETPGROUP;
+   }
+   posix_spawnattr_setflags(&attr, flags);
+
+   TRACE_START(lookup_start);
+   const char *path = path_lookup(cmd->args[0], 1);
+   TRACE_END(lookup_start, TRACE_LOOKUP, 0);
+   TRACE_START(spawn_start);
+   if (path == NULL) {
+      err = ENOENT;
+   }
+   else {
+      err = posix_spawn(&pid, path, &actions, &attr, cmd->args, environ);
+      // the cached file went away? forget it and search $PATH once more
+      if (err == ENOENT && path != cmd->args[0] && access(path, X_OK) == -1) {
+         path_cache_forget(cmd->args[0]);
+         path = path_lookup(cmd->args[0], 1);
+         err = path != NULL ? posix_spawn(&pid, path, &actions, &attr, cmd->args, environ)
+                            : ENOENT;
+      }
+   }
+   TRACE_END(spawn_start, TRACE_SPAWN, err == 0 ? pid : -1);
+
+   posix_spawnattr_destroy(&attr);
+   posix_spawn_file_actions_destroy(&actions);
+   close_heredocs(cmd);
+   if (err != 0) {
+      errno = err;
+      return -1;
+   }
+   return pid;
+}
+#else
+pid_t launch_command(const struct launch *l) {
+   return fork_command(l);
+}
+#endif
+
+// explain why launch_command() failed. posix_spawn only hands back an
+// errno, so on this (cold) path check which of the redirections is to blame.
+void report_launch_error(struct command *cmd) {
+   int err = errno;
+   for (struct redirect *r = cmd->redirects; r != NULL; r = r->next) {
+      if ((r->type == REDIR_IN && access(r->file, R_OK) == -1)
+          || ((r->type == REDIR_OUT || r->type == REDIR_APPEND)
+              && access(r->file, F_OK) == 0 && access(r->file, W_OK) == -1)) {
+         perror("open()");
+         return;
+      }
+      if (r->type == REDIR_DUP && err == EBADF && fcntl(r->from, F_GETFD) == -1) {
+         fprintf(stderr, "%d: bad file descriptor\n", r->from);
+         return;
+      }
+   }
+   errno = err;
+   perror("incorrect command");
+}
+
+/////////////////////////////////////////////////////////////////////////
+// pipelines
+/////////////////////////////////////////////////////////////////////////
+// Every stage is started right away, concurrently, wired to its neighbours
+// with pipe2(O_CLOEXEC) so the data never touches the disk. A background
+// pipeline gets a process group of its own (led by its first process);
+// so does a foreground one under job control, which also gets the
+// terminal. Otherwise it stays in the shell's group.
+//
+// If SMALLSH_PIPE_SIZE is set (bytes), each pipe is resized to it with
+// F_SETPIPE_SZ, for stages that move a lot of data.
+//
+// Fills in pids[] (one per stage, -1 for stages that couldn't be started)
+// and returns the # of processes that are actually running.
+/////////////////////////////////////////////////////////////////////////
+int launch_pipeline(struct command *first, int background, pid_t *pids) {
+   struct launch l;
+   struct command *cmd;
+   const char *pipe_size_env = getenv("SMALLSH_PIPE_SIZE");
+   int pipe_size = pipe_size_env != NULL ? atoi(pipe_size_env) : 0;
+   int fds[2];
+   int launched = 0;
+   int i = 0;
+
+   l.pipe_in = -1;
+   l.background = background;
+   l.pgid = background || job_control ? 0 : -1;
+   l.take_tty = !background && job_control;
+   for (cmd = first; cmd != NULL; cmd = cmd->next, i++) {
+      l.cmd = cmd;
+      l.pipe_out = -1;
+      if (cmd->next != NULL) { // not the last stage, needs a pipe
+         if (pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            fds[0] = fds[1] = -1;
+         }
+         else if (pipe_size > 0 && fcntl(fds[1], F_SETPIPE_SZ, pipe_size) == -1) {
+            perror("F_SETPIPE_SZ");
+         }
+         l.pipe_out = fds[1];
+      }
+
+      pids[i] = launch_command(&l);
+      if (pids[i] == -1) {
+         report_launch_error(cmd);
+      }
+      else {
+         launched++;
+         if (l.pgid == 0) { // first one in leads the group
+            l.pgid = pids[i];
+            if (l.take_tty) { // it may already have (see above), no harm
+               tcsetpgrp(STDIN_FILENO, l.pgid);
+            }
+         }
+      }
+
+      // the children have their copies now
+      if (l.pipe_in != -1) {
+         close(l.pipe_in);
+      }
+      if (l.pipe_out != -1) {
+         close(l.pipe_out);
+      }
+      l.pipe_in = cmd->next != NULL ? fds[0] : -1;
+   }
+   return launched;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// parallel command (built-in)
+/////////////////////////////////////////////////////////////////////////
+//    parallel [-j N] command [args...] ::: item1 item2 ...
+//
+// Runs command once per item, with every {} in its args replaced by the
+// item (or the item tacked on the end if there's no {}). At most N of
+// them (default: # of online cpus) run at once; when N are going, the
+// shell blocks in the reaper until one finishes before starting the next.
+// The jobs share the terminal's stdout, scheduling output is not printed.
+// Redirections on the parallel command apply to every job. The files are
+// opened once for the whole batch, so the jobs all write through the
+// same open file (like { ...; } > file would) instead of each truncating
+// it again.
+//
+// Returns a waitpid()-style status whose exit value is the # of jobs that
+// failed (capped at 101, like GNU parallel), so `status` reports it.
+/////////////////////////////////////////////////////////////////////////
+// copy of arg with every {} replaced by item
+static char *parallel_subst(struct arena *a, const char *arg, const char *item) {
+   size_t item_len = strlen(item);
+   size_t len = 0;
+   const char *p;
+   for (p = arg; *p != '\0'; p++) { // measure
+      if (p[0] == '{' && p[1] == '}') {
+         len += item_len;
+         p++;
+      }
+      else {
+         len++;
+      }
+   }
+   char *out = arena_alloc(a, len + 1);
+   char *o = out;
+   for (p = arg; *p != '\0'; p++) { // copy
+      if (p[0] == '{' && p[1] == '}') {
+         memcpy(o, item, item_len);
+         o += item_len;
+         p++;
+      }
+      else {
+         *o++ = *p;
+      }
+   }
+   *o = '\0';
+   return out;
+}
+
+// redirects with the files opened (and here-docs filled in) once, as
+// dups of the shell's own fds, for every job of a batch. The dups that
+// own their fd keep the file name, for close_batch(). Sets *ok to 0 if
+// one can't be opened (which is reported).
+static void close_batch(struct redirect *shared) {
+   for (struct redirect *r = shared; r != NULL; r = r->next) {
+      if (r->type == REDIR_DUP && r->file != NULL) {
+         close(r->from);
+      }
+   }
+}
+
+static struct redirect *batch_redirects(struct arena *a, struct redirect *redirects,
+                                        int *ok) {
+   struct command shared; // just for its list
+   shared.redirects = NULL;
+   shared.redirects_tail = &shared.redirects;
+   *ok = 1;
+   for (struct redirect *r = redirects; r != NULL; r = r->next) {
+      int fd;
+      if (r->type == REDIR_DUP || r->type == REDIR_CLOSE) {
+         command_add_redirect(a, &shared, r->type, r->fd, NULL, r->from);
+         continue;
+      }
+      if (r->type == REDIR_HEREDOC) {
+         fd = heredoc_fd(r->file);
+      }
+      else {
+         fd = open(r->file, redirect_flags(r->type) | O_CLOEXEC, 0644);
+         fd = fd != -1 ? high_fd(fd) : -1;
+      }
+      if (fd == -1) {
+         perror(r->type == REDIR_HEREDOC ? "here-document" : r->file);
+         close_batch(shared.redirects);
+         *ok = 0;
+         return NULL;
+      }
+      command_add_redirect(a, &shared, REDIR_DUP, r->fd, r->file, fd);
+   }
+   return shared.redirects;
+}
+
+int parallel_builtin(struct arena *a, char **args, int num_args,
+                     struct redirect *redirects) {
+   int max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+   int first = 1; // index of the command in args
+   int sep; // index of :::
+   int has_braces = 0;
+   int total = 0;
+   struct redirect *shared; // the parallel command's own, for every job
+   int ok;
+   int i, j;
+
+   if (first < num_args && strncmp(args[first], "-j", 2) == 0) {
+      if (args[first][2] != '\0') { // -jN
+         max_jobs = atoi(args[first] + 2);
+         first++;
+      }
+      else if (first + 1 < num_args) { // -j N
+         max_jobs = atoi(args[first + 1]);
+         first += 2;
+      }
+   }
+   for (sep = first; sep < num_args && strcmp(args[sep], ":::") != 0; sep++) {
+      if (strstr(args[sep], "{}") != NULL) {
+         has_braces = 1;
+      }
+   }
+   if (sep == first || sep == num_args || max_jobs < 1) {
+      printf("usage: parallel [-j N] command [args...] ::: items...\n");
+      return W_EXITCODE(2, 0);
+   }
+   shared = batch_redirects(a, redirects, &ok);
+   if (!ok) {
+      return W_EXITCODE(1, 0);
+   }
+
+   batch_live = 0;
+   batch_failed = 0;
+   fflush(stdout);
+   for (i = sep + 1; i < num_args; i++) {
+      // wait for a free slot
+      while (batch_live >= max_jobs && reap_children(1) > 0) {
+         ;
+      }
+
+      // argv for this item
+      struct command *cmd = command_new(a);
+      for (j = first; j < sep; j++) {
+         command_add_arg(a, cmd, has_braces ? parallel_subst(a, args[j], args[i])
+                                            : args[j]);
+      }
+      if (!has_braces) {
+         command_add_arg(a, cmd, args[i]);
+      }
+      if (!command_prefixes(a, cmd)) { // pin {} with a bad item, say
+         batch_failed++;
+         total++;
+         continue;
+      }
+      // the jobs can't all read the terminal
+      command_add_redirect(a, cmd, REDIR_DUP, 0, NULL, devnull_fd);
+      *cmd->redirects_tail = shared;
+
+      if (!spawn_wait(1)) { // ctrl-c'd, forget the rest
+         break;
+      }
+      struct launch l = { cmd, -1, -1, 0, -1, 0 };
+      pid_t pid = launch_command(&l);
+      total++;
+      if (pid == -1) {
+         report_launch_error(cmd);
+         batch_failed++;
+         continue;
+      }
+      job_add(&pid, 1, args[i])->batch = 1;
+      batch_live++;
+   }
+   while (batch_live > 0 && reap_children(1) > 0) { // wait for the stragglers
+      ;
+   }
+   close_batch(shared);
+
+   if (batch_failed > 0) {
+      printf("parallel: %d of %d jobs failed\n", batch_failed, total);
+   }
+   return W_EXITCODE(batch_failed > 101 ? 101 : batch_failed, 0);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// utility built-ins
+/////////////////////////////////////////////////////////////////////////
+// echo, true, false, test (and [) and printf are what scripts run most,
+// so the shell does them itself instead of launching /bin/echo & co:
+// a few microseconds instead of a whole process. They behave like the
+// coreutils versions (the common options, anyway), and like external
+// commands they set the status and honour < and > files, which are
+// swapped in for fds 0 and 1 while the built-in runs. & is ignored, the
+// same as for the other built-ins. In a pipeline they're still exec()d.
+//
+// Diagnostics go to stderr, the exit codes are the usual ones (test: 0
+// true, 1 false, 2 bad expression).
+/////////////////////////////////////////////////////////////////////////
+// Print the backslash escape at s (s[0] is the '\'). zero_octal: octal
+// is written \0nnn (echo -e, printf %b) rather than \nnn (printf's
+// format). Returns the last char used, or NULL for a \c, which means
+// stop printing altogether.
+static const char *put_escape(const char *s, int zero_octal) {
+   static const char from[] = "abefnrtv\\";
+   static const char to[] = "\a\b\033\f\n\r\t\v\\";
+   const char *e;
+   int c, digits;
+
+   s++;
+   if (*s == 'c') {
+      return NULL;
+   }
+   if (*s != '\0' && (e = strchr(from, *s)) != NULL) {
+      putchar(to[e - from]);
+   }
+   else if ((zero_octal && *s == '0') || (!zero_octal && *s >= '0' && *s <= '7')) {
+      s += zero_octal;
+      for (c = 0, digits = 0; digits < 3 && *s >= '0' && *s <= '7'; digits++, s++) {
+         c = c * 8 + (*s - '0');
+      }
+      putchar(c);
+      s--;
+   }
+   else if (*s == 'x' && isxdigit((unsigned char)s[1])) {
+      for (c = 0, digits = 0; digits < 2 && isxdigit((unsigned char)s[1]); digits++) {
+         s++;
+         c = c * 16 + (isdigit((unsigned char)*s) ? *s - '0' : (*s | 0x20) - 'a' + 10);
+      }
+      putchar(c);
+   }
+   else { // not an escape, print it as is
+      putchar('\\');
+      if (*s == '\0') {
+         s--;
+      }
+      else {
+         putchar(*s);
+      }
+   }
+   return s;
+}
+
+// print s, expanding escapes. Returns 1 if a \c stopped it.
+static int put_escaped(const char *s, int zero_octal) {
+   for (; *s != '\0'; s++) {
+      if (*s != '\\') {
+         putchar(*s);
+      }
+      else if ((s = put_escape(s, zero_octal)) == NULL) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// echo [-neE] [args...]
+static int echo_builtin(char **args, int num_args) {
+   int newline = 1;
+   int escapes = 0;
+   int i;
+
+   for (i = 1; i < num_args && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+      const char *o = args[i] + 1;
+      if (strspn(o, "neE") != strlen(o)) {
+         break; // not all options, it's the first thing to print
+      }
+      for (; *o != '\0'; o++) {
+         if (*o == 'n') {
+            newline = 0;
+         }
+         else {
+            escapes = *o == 'e';
+         }
+      }
+   }
+   for (; i < num_args; i++) {
+      if (!escapes) {
+         fputs(args[i], stdout);
+      }
+      else if (put_escaped(args[i], 1)) {
+         return 0;
+      }
+      if (i + 1 < num_args) {
+         putchar(' ');
+      }
+   }
+   if (newline) {
+      putchar('\n');
+   }
+   return 0;
+}
+
+static int true_builtin(char **args, int num_args) {
+   return 0;
+}
+
+static int false_builtin(char **args, int num_args) {
+   return 1;
+}
+
+// test's state: what's left of its args, and what went wrong
+struct test_state {
+   char **args;
+   int pos; // next arg to look at
+   int end; // one past the last arg (the ] for `[`)
+   const char *error; // set if the expression is bad
+   const char *error_arg;
+};
+
+static int test_is(struct test_state *t, int at, const char *s) {
+   return at < t->end && strcmp(t->args[at], s) == 0;
+}
+
+static long long test_int(struct test_state *t, const char *s) {
+   char *end;
+   errno = 0;
+   long long n = strtoll(s, &end, 10);
+   while (*end == ' ' || *end == '\t') {
+      end++;
+   }
+   if (end == s || *end != '\0' || errno != 0) {
+      t->error = "integer expression expected";
+      t->error_arg = s;
+   }
+   return n;
+}
+
+static int test_unary(struct test_state *t, char op, const char *arg) {
+   struct stat st;
+   switch (op) {
+   case 'n': return arg[0] != '\0';
+   case 'z': return arg[0] == '\0';
+   case 't': return isatty(test_int(t, arg));
+   case 'r': return access(arg, R_OK) == 0;
+   case 'w': return access(arg, W_OK) == 0;
+   case 'x': return access(arg, X_OK) == 0;
+   case 'h':
+   case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+   }
+   if (stat(arg, &st) == -1) {
+      return 0;
+   }
+   switch (op) {
+   case 'e': return 1;
+   case 'f': return S_ISREG(st.st_mode);
+   case 'd': return S_ISDIR(st.st_mode);
+   case 'b': return S_ISBLK(st.st_mode);
+   case 'c': return S_ISCHR(st.st_mode);
+   case 'p': return S_ISFIFO(st.st_mode);
+   case 'S': return S_ISSOCK(st.st_mode);
+   case 's': return st.st_size > 0;
+   case 'g': return (st.st_mode & S_ISGID) != 0;
+   case 'u': return (st.st_mode & S_ISUID) != 0;
+   case 'k': return (st.st_mode & S_ISVTX) != 0;
+   case 'O': return st.st_uid == geteuid();
+   default: return st.st_gid == getegid(); // 'G'
+   }
+}
+
+// 1 if op is a binary operator, its result in *r
+static int test_binary(struct test_state *t, const char *a, const char *op,
+                       const char *b, int *r) {
+   static const char *const int_ops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL };
+   struct stat sa, sb;
+   int i;
+
+   if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+      *r = strcmp(a, b) == 0;
+   }
+   else if (strcmp(op, "!=") == 0) {
+      *r = strcmp(a, b) != 0;
+   }
+   else if (strcmp(op, "<") == 0 || strcmp(op, ">") == 0) {
+      *r = op[0] == '<' ? strcmp(a, b) < 0 : strcmp(a, b) > 0;
+   }
+   else if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+      int ha = stat(a, &sa) == 0;
+      int hb = stat(b, &sb) == 0;
+      if (op[1] == 'e') {
+         *r = ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+      }
+      else {
+         // a file that doesn't exist is older than one that does
+         long long d = !ha || !hb ? ha - hb
+            : sa.st_mtim.tv_sec != sb.st_mtim.tv_sec ? sa.st_mtim.tv_sec - sb.st_mtim.tv_sec
+            : sa.st_mtim.tv_nsec - sb.st_mtim.tv_nsec;
+         *r = op[1] == 'n' ? d > 0 : d < 0;
+      }
+   }
+   else {
+      for (i = 0; int_ops[i] != NULL && strcmp(op, int_ops[i]) != 0; i++) {
+         ;
+      }
+      if (int_ops[i] == NULL) {
+         return 0;
+      }
+      long long x = test_int(t, a);
+      long long y = test_int(t, b);
+      int cmp = (x > y) - (x < y);
+      int want[] = { cmp == 0, cmp != 0, cmp < 0, cmp <= 0, cmp > 0, cmp >= 0 };
+      *r = want[i];
+   }
+   return 1;
+}
+
+static int test_or(struct test_state *t);
+
+// ( expr ) | unary-op arg | arg binary-op arg | arg
+static int test_primary(struct test_state *t) {
+   char **args = t->args;
+   int r;
+
+   if (t->pos >= t->end) {
+      t->error = "argument expected";
+      return 0;
+   }
+   // a binary operator in the middle wins, so `test -n = -n` compares
+   if (t->pos + 2 < t->end
+       && test_binary(t, args[t->pos], args[t->pos + 1], args[t->pos + 2], &r)) {
+      t->pos += 3;
+      return r;
+   }
+   if (strcmp(args[t->pos], "(") == 0) {
+      t->pos++;
+      r = test_or(t);
+      if (!test_is(t, t->pos, ")")) {
+         t->error = "missing `)'";
+         return 0;
+      }
+      t->pos++;
+      return r;
+   }
+   if (args[t->pos][0] == '-' && args[t->pos][1] != '\0' && args[t->pos][2] == '\0'
+       && strchr("nztrwxhLefdbcpSsgukOG", args[t->pos][1]) != NULL
+       && t->pos + 1 < t->end) {
+      t->pos += 2;
+      return test_unary(t, args[t->pos - 2][1], args[t->pos - 1]);
+   }
+   return args[t->pos++][0] != '\0'; // just a string: is it non-empty?
+}
+
+static int test_not(struct test_state *t) {
+   if (test_is(t, t->pos, "!") && t->pos + 1 < t->end) {
+      t->pos++;
+      return !test_not(t);
+   }
+   return test_primary(t);
+}
+
+static int test_and(struct test_state *t) {
+   int r = test_not(t);
+   while (t->error == NULL && test_is(t, t->pos, "-a")) {
+      t->pos++;
+      r = test_not(t) && r;
+   }
+   return r;
+}
+
+static int test_or(struct test_state *t) {
+   int r = test_and(t);
+   while (t->error == NULL && test_is(t, t->pos, "-o")) {
+      t->pos++;
+      r = test_and(t) || r;
+   }
+   return r;
+}
+
+// test expr, or [ expr ]
+static int test_builtin(char **args, int num_args) {
+   struct test_state t = { args, 1, num_args, NULL, NULL };
+   int r;
+
+   if (strcmp(args[0], "[") == 0) {
+      if (strcmp(args[num_args - 1], "]") != 0) {
+         fprintf(stderr, "[: missing `]'\n");
+         return 2;
+      }
+      t.end--;
+   }
+   if (t.pos == t.end) { // no expression is false
+      return 1;
+   }
+   r = test_or(&t);
+   if (t.error == NULL && t.pos < t.end) {
+      t.error = "too many arguments";
+   }
+   if (t.error != NULL) {
+      if (t.error_arg != NULL) {
+         fprintf(stderr, "%s: %s: %s\n", args[0], t.error_arg, t.error);
+      }
+      else {
+         fprintf(stderr, "%s: %s\n", args[0], t.error);
+      }
+      return 2;
+   }
+   return !r;
+}
+
+// printf's numeric args: 'c is the char's value, like printf(1)
+static long long printf_int(const char *s, int *status) {
+   char *end;
+   if (s == NULL || s[0] == '\0') {
+      return 0;
+   }
+   if (s[0] == '\'' || s[0] == '"') {
+      return (unsigned char)s[1];
+   }
+   errno = 0;
+   long long n = strtoll(s, &end, 0);
+   if (*end != '\0' || errno != 0) {
+      fprintf(stderr, "printf: %s: invalid number\n", s);
+      *status = 1;
+   }
+   return n;
+}
+
+static double printf_double(const char *s, int *status) {
+   char *end;
+   if (s == NULL || s[0] == '\0') {
+      return 0;
+   }
+   double d = strtod(s, &end);
+   if (*end != '\0') {
+      fprintf(stderr, "printf: %s: invalid number\n", s);
+      *status = 1;
+   }
+   return d;
+}
+
+// printf format [args...]. The format is reused until the args run out.
+static int printf_builtin(char **args, int num_args) {
+   char spec[64]; // one conversion, rebuilt for the C printf
+   const char *p;
+   int next = 2; // next arg to convert
+   int status = 0;
+   int first_arg;
+   size_t n;
+
+   if (num_args < 2) {
+      fprintf(stderr, "usage: printf format [arguments...]\n");
+      return 2;
+   }
+   do {
+      first_arg = next;
+      for (p = args[1]; *p != '\0'; p++) {
+         if (*p == '\\') {
+            if ((p = put_escape(p, 0)) == NULL) {
+               return status;
+            }
+            continue;
+         }
+         if (*p != '%') {
+            putchar(*p);
+            continue;
+         }
+         if (p[1] == '%') {
+            putchar('%');
+            p++;
+            continue;
+         }
+
+         // %[flags][width][.precision]conversion, * taking an arg
+         n = 0;
+         spec[n++] = *p++;
+         while (*p != '\0' && strchr("-+ #0", *p) != NULL && n < 8) {
+            spec[n++] = *p++;
+         }
+         for (int part = 0; part < 2; part++) {
+            if (*p == '*') {
+               n += sprintf(spec + n, "%d", (int)printf_int(next < num_args ? args[next++]
+                                                                          : NULL, &status));
+               p++;
+            }
+            while (*p >= '0' && *p <= '9' && n < 40) {
+               spec[n++] = *p++;
+            }
+            if (part == 0 && *p == '.') {
+               spec[n++] = *p++;
+            }
+            else {
+               break;
+            }
+         }
+         const char *arg = next < num_args ? args[next++] : NULL;
+         switch (*p) {
+         case 'd': case 'i':
+            strcpy(spec + n, "lld");
+            printf(spec, printf_int(arg, &status));
+            break;
+         case 'o': case 'u': case 'x': case 'X':
+            spec[n++] = 'l';
+            spec[n++] = 'l';
+            spec[n++] = *p;
+            spec[n] = '\0';
+            printf(spec, (unsigned long long)printf_int(arg, &status));
+            break;
+         case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            spec[n++] = *p;
+            spec[n] = '\0';
+            printf(spec, printf_double(arg, &status));
+            break;
+         case 'c':
+            strcpy(spec + n, "c");
+            if (arg != NULL && arg[0] != '\0') {
+               printf(spec, arg[0]);
+            }
+            break;
+         case 's':
+            strcpy(spec + n, "s");
+            printf(spec, arg != NULL ? arg : "");
+            break;
+         case 'b':
+            if (arg != NULL && put_escaped(arg, 1)) {
+               return status;
+            }
+            break;
+         case '\0':
+            fprintf(stderr, "printf: missing format character\n");
+            return 1;
+         default:
+            fprintf(stderr, "printf: %%%c: invalid conversion\n", *p);
+            return 1;
+         }
+      }
+   } while (next < num_args && next > first_arg);
+   return status;
+}
+
+struct utility {
+   const char *name;
+   int (*run)(char **args, int num_args); // returns the exit code
+};
+
+const struct utility utilities[] = {
+   { "echo", echo_builtin },
+   { "true", true_builtin },
+   { "false", false_builtin },
+   { "test", test_builtin },
+   { "[", test_builtin },
+   { "printf", printf_builtin },
+   { "trace", trace_builtin }, // not a utility, but wants > files too
+   { NULL, NULL }
+};
+
+const struct utility *find_utility(const char *name) {
+   for (const struct utility *u = utilities; u->name != NULL; u++) {
+      if (strcmp(u->name, name) == 0) {
+         return u;
+      }
+   }
+   return NULL;
+}
+
+// apply one of a built-in's redirections to the shell itself, stashing
+// the shell's own fd in saved[r->fd] the first time it's changed (-1 if
+// it wasn't open), and noting in *cloexec whether it was close-on-exec.
+// Returns -1 if it can't be done.
+static int redirect_fd(const struct redirect *r, int *saved, unsigned *cloexec) {
+   int file_fd;
+   if (saved[r->fd] == -2) {
+      int flags = fcntl(r->fd, F_GETFD);
+      if (flags != -1 && (flags & FD_CLOEXEC)) {
+         *cloexec |= 1u << r->fd;
+      }
+      saved[r->fd] = fcntl(r->fd, F_DUPFD_CLOEXEC, REDIRECT_FD_MAX + 1);
+   }
+   if (r->type == REDIR_CLOSE) {
+      close(r->fd);
+      return 0;
+   }
+   if (r->type == REDIR_APPEND && (file_fd = append_fd(r->file)) != -1) {
+      dup2(file_fd, r->fd); // the cache keeps its fd
+      return 0;
+   }
+   if (r->type == REDIR_DUP) {
+      if (dup2(r->from, r->fd) == -1) {
+         fprintf(stderr, "%d: bad file descriptor\n", r->from);
+         return -1;
+      }
+      return 0;
+   }
+   if (r->type == REDIR_HEREDOC) {
+      file_fd = heredoc_fd(r->file);
+   }
+   else {
+      file_fd = open(r->file, redirect_flags(r->type) | O_CLOEXEC, 0644);
+   }
+   if (file_fd == -1) {
+      perror(r->type == REDIR_HEREDOC ? "here-document" : "open()");
+      return -1;
+   }
+   dup2(file_fd, r->fd);
+   close(file_fd);
+   return 0;
+}
+
+// put fd back the way it was; dup2() alone would leave it inheritable
+static void restore_fd(int fd, int saved, int cloexec) {
+   if (saved == -1) {
+      close(fd);
+   }
+   else {
+      dup3(saved, fd, cloexec ? O_CLOEXEC : 0);
+      close(saved);
+   }
+}
+
+// run a utility built-in with cmd's redirections applied to the shell's
+// own fds, and put them back afterwards
+int run_utility(const struct utility *u, struct command *cmd) {
+   int saved[REDIRECT_FD_MAX + 1]; // -2 if the fd was left alone
+   unsigned cloexec = 0; // bit n: fd n was close-on-exec
+   int result = 1; // a file that can't be opened fails the command
+   struct redirect *r;
+   int fd;
+
+   for (fd = 0; fd <= REDIRECT_FD_MAX; fd++) {
+      saved[fd] = -2;
+   }
+   fflush(stdout); // what's printed so far goes to the shell's stdout
+   for (r = cmd->redirects; r != NULL; r = r->next) {
+      if (redirect_fd(r, saved, &cloexec) == -1) {
+         break;
+      }
+   }
+   if (r == NULL) {
+      result = u->run(cmd->args, cmd->num_args);
+      fflush(stdout);
+   }
+   for (fd = 0; fd <= REDIRECT_FD_MAX; fd++) {
+      if (saved[fd] != -2) {
+         restore_fd(fd, saved[fd], cloexec & (1u << fd));
+      }
+   }
+   return result;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// job control
+/////////////////////////////////////////////////////////////////////////
+// When a person is typing at us (stdin is a terminal) every job runs in
+// a process group of its own and the foreground one owns the terminal,
+// so ctrl-c and ctrl-z go to it rather than to the shell or the bgr
+// jobs. A job that gets stopped stays in the job table, and the
+// built-ins below pick it up again:
+//
+//    jobs [-l]        list the jobs (-l: with their process group ids)
+//    fg [%n]          continue a job in the foreground
+//    bg [%n]          continue a stopped job in the background
+//    wait [%n|pid]    wait for a job, or for all the running bgr jobs
+//
+// %n is the job # that jobs shows; %+, %% or no job at all means the
+// current job, the one most recently stopped or sent to the bgr. Ctrl-z
+// at the prompt, with nothing in the foreground, still toggles
+// foreground-only mode.
+/////////////////////////////////////////////////////////////////////////
+pid_t shell_pgid = -1; // the shell's own process group
+struct termios shell_tmodes; // terminal settings to put back at the prompt
+
+// exit code of a waitpid() status, the way sh reports it (128 + signal #
+// if it was killed)
+int exit_code(int status) {
+   if (WIFSIGNALED(status)) {
+      return 128 + WTERMSIG(status);
+   }
+   return WEXITSTATUS(status);
+}
+
+// send sig to every process of a job
+void job_signal(struct job *job, int sig) {
+   if (job->pgid != -1 && kill(-job->pgid, sig) == 0) {
+      return;
+   }
+   // not a group of its own (a foreground job without job control)
+   for (int i = 0; i < job->num_pids; i++) {
+      if (job->pids[i] != -1 && job_by_pid(job->pids[i]) == job) {
+         kill(job->pids[i], sig);
+      }
+   }
+}
+
+// the job a %n, %+, %% or pid names (NULL: the current job), or NULL if
+// there's no such job
+struct job *job_find(const char *spec) {
+   struct job *job = NULL;
+   if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+      for (int i = job_live; i != -1; i = jobs[i].next) {
+         if (!jobs[i].batch && !jobs[i].foreground && (job == NULL || jobs[i].seq > job->seq)) {
+            job = &jobs[i];
+         }
+      }
+      return job;
+   }
+   if (spec[0] == '%') {
+      char *end;
+      long n = strtol(spec + 1, &end, 10);
+      if (*end != '\0' || n < 1 || n > jobs_cap) {
+         return NULL;
+      }
+      job = &jobs[n - 1];
+   }
+   else if (atoi(spec) > 0) {
+      job = job_by_pid(atoi(spec));
+   }
+   if (job == NULL || job->state == JOB_FREE || job->batch || job->foreground) {
+      return NULL;
+   }
+   return job;
+}
+
+// any bgr jobs still running (stopped ones would never finish)?
+static int jobs_running(void) {
+   for (int i = job_live; i != -1; i = jobs[i].next) {
+      if (jobs[i].state == JOB_RUNNING && !jobs[i].batch && !jobs[i].foreground) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// Wait for the foreground job until every process of it is done, or it
+// stops. Returns 0 once it's done, or the signal that stopped it.
+int wait_job(struct job *job) {
+   int status;
+   struct rusage ru;
+
+   for (int i = 0; i < job->num_pids; i++) {
+      pid_t pid = job->pids[i];
+      if (pid == -1 || job_by_pid(pid) != job) {
+         continue; // never started, or reaped before it was stopped
+      }
+      TRACE_START(wait_start);
+      if (wait4(pid, &status, WUNTRACED, &ru) == -1) {
+         if (errno == EINTR) {
+            i--;
+            continue;
+         }
+         status = W_EXITCODE(1, 0); // someone else reaped it?
+         memset(&ru, 0, sizeof(ru));
+      }
+      TRACE_END(wait_start, TRACE_WAIT, pid);
+      if (WIFSTOPPED(status)) {
+         job->state = JOB_STOPPED;
+         return WSTOPSIG(status);
+      }
+      pid_index_del(pid);
+      job->live--;
+      rusage_add(&job->usage.ru, &ru);
+      if (i == job->num_pids - 1) { // pipeline status is the last one's
+         job->status = status;
+      }
+   }
+   job->state = JOB_DONE;
+   job->usage.real = secs_since(&job->start);
+   return 0;
+}
+
+// Run job in the foreground (continuing it first if cont) until it's done
+// or it stops, then take the terminal back. Returns 0 if it's done (the
+// caller removes it), or the signal that stopped it.
+int run_fg(struct job *job, int cont) {
+   int stopped;
+
+   job->foreground = 1;
+   if (job_control && job->pgid != -1) {
+      tcsetpgrp(STDIN_FILENO, job->pgid);
+      if (cont && job->has_tmodes) {
+         tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+      }
+   }
+   if (cont) {
+      job->state = JOB_RUNNING;
+      job_signal(job, SIGCONT);
+   }
+   stopped = wait_job(job);
+   job->foreground = 0;
+   if (job_control) {
+      tcsetpgrp(STDIN_FILENO, shell_pgid);
+      if (stopped) { // keep its settings (an editor's raw mode, say)
+         job->has_tmodes = tcgetattr(STDIN_FILENO, &job->tmodes) == 0;
+      }
+      tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+   }
+   if (stopped) {
+      job->seq = ++job_seq;
+      printf("\n[%d]+  %-24s%s\n", (int)(job - jobs) + 1, "Stopped", job->cmdline);
+   }
+   return stopped;
+}
+
+int jobs_builtin(char **args, int num_args) {
+   int long_form = num_args > 1 && strcmp(args[1], "-l") == 0;
+   struct job *current;
+
+   reap_children(0); // report the ones that are done first
+   notices_flush(NULL);
+   current = job_find(NULL);
+   for (int i = 0; i < jobs_cap; i++) {
+      struct job *job = &jobs[i];
+      if (job->state == JOB_FREE || job->batch || job->foreground) {
+         continue;
+      }
+      printf("[%d]%c  ", i + 1, job == current ? '+' : ' ');
+      if (long_form) {
+         printf("%d ", job->pgid);
+      }
+      printf("%-24s%s\n", job->state == JOB_STOPPED ? "Stopped" : "Running", job->cmdline);
+   }
+   return 0;
+}
+
+int bg_builtin(char **args, int num_args) {
+   struct job *job = job_find(num_args > 1 ? args[1] : NULL);
+   if (job == NULL) {
+      fprintf(stderr, "bg: %s: no such job\n", num_args > 1 ? args[1] : "current");
+      return 1;
+   }
+   if (job->state == JOB_STOPPED) {
+      job->state = JOB_RUNNING;
+      job->seq = ++job_seq;
+      job_signal(job, SIGCONT);
+   }
+   printf("[%d]+ %s\n", (int)(job - jobs) + 1, job->cmdline);
+   return 0;
+}
+
+int wait_builtin(char **args, int num_args) {
+   int result = 0;
+
+   if (num_args == 1) {
+      while (jobs_running() && reap_children(1) > 0) {
+         ;
+      }
+      notices_flush(NULL); // what we waited for, before what comes next
+      return 0;
+   }
+   for (int i = 1; i < num_args; i++) {
+      struct job *job = job_find(args[i]);
+      if (job == NULL) {
+         fprintf(stderr, "wait: %s: no such job\n", args[i]);
+         result = 127;
+         continue;
+      }
+      pid_t pgid = job->pgid;
+      while (job->state == JOB_RUNNING && reap_children(1) > 0) {
+         ;
+      }
+      if (job->state == JOB_STOPPED) {
+         result = 128 + SIGTSTP;
+      }
+      else {
+         result = last_done_pgid == pgid ? exit_code(last_done_status) : 127;
+      }
+   }
+   notices_flush(NULL);
+   return result;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// kill off the background jobs, for exit and end of input
+/////////////////////////////////////////////////////////////////////////
+// Every job's process group gets a SIGTERM at once (a stopped one a
+// SIGCONT as well, or it would never see it), and one waitpid(-1) loop
+// collects them as they go. Whatever is still around after a grace
+// period of $SMALLSH_EXIT_GRACE seconds (default 2, 0 to skip straight
+// to it) gets a SIGKILL. So exiting takes about as long as the slowest
+// job does to clean up, not all of them added up.
+/////////////////////////////////////////////////////////////////////////
+#define EXIT_GRACE 2.0
+
+// reap the jobs' processes that are done, counting them off left. Each
+// one leaves the pid index, and a job with none left is JOB_DONE, so
+// nothing gets signalled by a pid that may have been reused since.
+static int kill_jobs_reap(int left, int options) {
+   struct job *job;
+   int status;
+   pid_t pid;
+   while (left > 0 && (pid = waitpid(-1, &status, options)) > 0) {
+      options |= WNOHANG; // blocking mode only waits for the first one
+      if ((job = job_by_pid(pid)) == NULL) {
+         continue;
+      }
+      pid_index_del(pid);
+      if (--job->live == 0) {
+         job->state = JOB_DONE;
+      }
+      left--;
+   }
+   return left;
+}
+
+void kill_jobs(void) {
+   struct pollfd pipe_fd = { signal_pipe[0], POLLIN, 0 };
+   const char *env = getenv("SMALLSH_EXIT_GRACE");
+   double grace = env != NULL ? atof(env) : EXIT_GRACE;
+   struct timespec start;
+   int left = 0; // processes not reaped yet
+
+   for (int i = job_live; i != -1; i = jobs[i].next) {
+      if (jobs[i].state == JOB_DONE) {
+         continue;
+      }
+      left += jobs[i].live;
+      job_signal(&jobs[i], SIGTERM);
+      if (jobs[i].state == JOB_STOPPED) {
+         job_signal(&jobs[i], SIGCONT);
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   while ((left = kill_jobs_reap(left, WNOHANG)) > 0) {
+      double secs = grace - secs_since(&start);
+      if (secs <= 0) {
+         break;
+      }
+      poll(&pipe_fd, 1, (int)(secs * 1000) + 1); // a SIGCHLD wakes it
+      signals_drain();
+   }
+   if (left == 0) {
+      return;
+   }
+   for (int i = job_live; i != -1; i = jobs[i].next) {
+      if (jobs[i].state != JOB_DONE) {
+         job_signal(&jobs[i], SIGKILL);
+      }
+   }
+   kill_jobs_reap(left, 0);
+}
 
-// catch ctrl-c
-void catchSIGINT(int signo) {
-   char* message = "Caught SIGINT\n";
-   write(STDOUT_FILENO, message, 14);
+/////////////////////////////////////////////////////////////////////////
+// running commands
+/////////////////////////////////////////////////////////////////////////
+// The syntax tree is walked right here in the shell: for, while & if
+// just loop over (or pick between) their lists, expanding loop variables
+// from the variable table, so the only processes started are the ones
+// the commands themselves need. Each pipeline hands back what it used of
+// the per-command arena, however many times a loop runs it.
+//
+// Every run_ function returns an exit code like sh's $? (0 is success,
+// 128 + signal # if a command was killed), which is what a while/if
+// condition tests.
+/////////////////////////////////////////////////////////////////////////
+struct arena cmd_arena; // per-command storage, reset every trip thru the shell loop
+int childExitMethod = -5; // waitpid() status of the last foreground command
+struct usage fg_usage; // and its resource usage, for status -v
+
+// put job in the foreground until it's done or stopped, and set the
+// status from it like for any foreground command. Returns its exit code.
+int foreground_job(struct job *job, int cont) {
+   int stopped = run_fg(job, cont);
+   int term_signal;
+
+   if (stopped) {
+      caught_sigint = 1; // don't go on with the rest of a loop either
+      return 128 + stopped;
+   }
+   childExitMethod = job->status;
+   fg_usage = job->usage;
+   job_remove(job);
+   // if child killed by signal, print out signal #
+   if (WIFSIGNALED(childExitMethod) != 0) {
+      // the process was terminated by a signal
+      term_signal = WTERMSIG(childExitMethod);
+      if (term_signal != 11) {
+         printf("terminated by signal %d\n", term_signal);
+      }
+      if (term_signal == SIGINT) { // ctrl-c'd, stop any loop it's in
+         caught_sigint = 1;
+      }
+   }
+   return exit_code(childExitMethod);
 }
 
-// catch ctrl-z
-void catchSIGTSTP (int signo) {
-   char* enter_fg_mode = "Entering foreground-only mode (& is now ignored)\n: ";
-   char* exit_fg_mode = "Exiting foreground-only mode\n: ";
-   if (fg_only_mode == 0) { // if not already in fg only mode, switch
-      fg_only_mode = 1;
-      write(STDOUT_FILENO, enter_fg_mode, 49);
+// fg [%n] (built-in), see job control
+int fg_builtin(char **args, int num_args) {
+   struct job *job = job_find(num_args > 1 ? args[1] : NULL);
+   if (job == NULL) {
+      fprintf(stderr, "fg: %s: no such job\n", num_args > 1 ? args[1] : "current");
+      return 1;
+   }
+   printf("%s\n", job->cmdline);
+   fflush(stdout);
+   return foreground_job(job, 1);
+}
+
+int run_pipeline(struct pipe_node *p) {
+   TRACE_START(expand_start);
+   struct arena_mark mark = arena_save(&cmd_arena);
+   struct command *pipeline = expand_pipeline(&cmd_arena, p);
+   if (pipeline == NULL) { // a bad pin or limit prefix, already reported
+      TRACE_END(expand_start, TRACE_EXPAND, 0);
+      arena_restore(&cmd_arena, mark);
+      return 1;
+   }
+   int num_stages = p->num_stages; // # of commands in the pipeline
+   char **args = pipeline->args; // argv of the 1st stage (for built-ins)
+   int num_args = pipeline->num_args; // # of args of the 1st stage
+   char *command = num_args > 0 ? args[0] : ""; // store the command
+   int run_in_background = 0; // keeps track of whether its a bgr process
+   int result = 0; // exit code to hand back
+   pid_t *pids = NULL; // one per stage, filled in by launch_pipeline()
+   const struct utility *utility; // built-in echo & co, if that's what it is
+   struct job *job; // the launched pipeline
+
+   // processes and children
+   int exit_status = 0; // holds the exit status if one exists
+   int term_signal = 0; // holds the term signal if one exists
+   char *jobs_max_env; // $JOBS_MAX, max # of bgr jobs at once (0 == no cap)
+   int jobs_max = 0;
+
+   // for the time prefix
+   int ran_fg = 0; // set if this ran an external foreground command
+   struct timespec time_start; // when the timed command started
+   struct rusage self_start, self_end; // the shell's own usage around it
+
+   TRACE_END(expand_start, TRACE_EXPAND, 0);
+   TRACE_START(builtin_start);
+
+   // don't run it in the bgr if the command is echo or if fg only mode
+   if (p->background && fg_only_mode == 0 && strcmp(command, "echo") != 0) {
+      run_in_background = 1; // set flag only if conditions met
+   }
+   // time [command]: report how long the rest of the pipeline took
+   if (p->timed) {
+      clock_gettime(CLOCK_MONOTONIC, &time_start);
+      getrusage(RUSAGE_SELF, &self_start);
+   }
+   // built-ins only run as a single command, pipelines always go to exec(),
+   // and so does anything with a pin or limit in front of it
+   if (num_stages > 1 || pipeline->limits != NULL) {
+      command = "";
+   }
+
+
+   /////////////////////////////////////////////////////////////////////////
+   // exit command (built-in)
+   /////////////////////////////////////////////////////////////////////////
+   // When this command is run, shell kills any other processes or jobs that 
+   // the shell started before it terminates itself.
+   //
+   // Note: If the user tries to run a built in command in the background 
+   // with &, ignore it, and run it in the foreground.
+   /////////////////////////////////////////////////////////////////////////
+   if (num_stages == 1 && num_args == 0) {
+      // nothing to run (just redirections, or $vars that were empty)
+   }
+   else if (strcmp(command, "exit") == 0) {
+      // kill off any processes or commands before exiting...
+      if (state_file != NULL) {
+         state_save(state_file);
+      }
+      notices_flush(NULL); // last word from jobs that already finished
+      kill_jobs();
+      exit(0);
+   }
+
+   /////////////////////////////////////////////////////////////////////////
+   // cd command (built-in)
+   /////////////////////////////////////////////////////////////////////////
+   // changes directories
+   //
+   // By itself (cd), it changes the directory specified in the HOME env.
+   // variable (NOT the location where smallsh was executed from, unless 
+   // smallsh is located in the HOME dir).
+   // 
+   // It can take 1 arg: the path of the directory to change to. 
+   //
+   // Note: Supports exact and relative paths.
+   //////////////////////////////////////////////////////////////////////////
+   else if (strcmp(command, "cd") == 0) {
+      append_cache_clear(); // relative >> names may mean other files now
+      if (num_args == 1) { // an arg was not specified
+         // change location to dir specified in the HOME environment variable
+         result = chdir((getenv("HOME"))) == 0 ? 0 : 1;
+      }
+      else if (num_args == 2){ // 1 arg was specified
+         // change location to arg[1]
+         result = chdir(args[1]) == 0 ? 0 : 1;
+      }
+   }
+
+   /////////////////////////////////////////////////////////////////////////
+   // status command (built-in)
+   /////////////////////////////////////////////////////////////////////////
+   // prints out either:
+   //   the exit status 
+   //        OR
+   //   the termianting signal of the last *foreground* process.
+   //
+   // status -v also prints its wall time, cpu time, max rss & context
+   // switches (summed over a pipeline).
+   /////////////////////////////////////////////////////////////////////////
+   else if (strcmp(command, "status") == 0) {
+      if (WIFEXITED(childExitMethod) != 0) {
+         // terminated normally, get exit status
+         exit_status = WEXITSTATUS(childExitMethod);
+         printf("exit value %d\n", exit_status);
+      } // if here, not exited normally
+      else if (WIFSIGNALED(childExitMethod) != 0) {
+        // the process was terminated by a signal
+        term_signal = WTERMSIG(childExitMethod);
+        printf("terminated by signal %d\n", term_signal);
+      } 
+      if (num_args > 1 && strcmp(args[1], "-v") == 0) {
+         print_usage(&fg_usage);
+         print_spawn_stats();
+      }
+   }
+
+   /////////////////////////////////////////////////////////////////////////
+   // hash command (built-in), see hash_builtin()
+   /////////////////////////////////////////////////////////////////////////
+   else if (strcmp(command, "hash") == 0) {
+      hash_builtin(args, num_args);
+   }
+
+   /////////////////////////////////////////////////////////////////////////
+   // throttle command (built-in), see spawn limits
+   /////////////////////////////////////////////////////////////////////////
+   else if (strcmp(command, "throttle") == 0) {
+      result = throttle_builtin(args, num_args);
+   }
+
+   /////////////////////////////////////////////////////////////////////////
+   // ulimit command (built-in), see resource limits & cpu placement
+   /////////////////////////////////////////////////////////////////////////
+   else if (strcmp(command, "ulimit") == 0) {
+      result = ulimit_builtin(args, num_args);
+   }
+
+   /////////////////////////////////////////////////////////////////////////
+   // history command (built-in), see history
+   /////////////////////////////////////////////////////////////////////////
+   else if (strcmp(command, "history") == 0) {
+      result = history_builtin(args, num_args);
+   }
+
+   /////////////////////////////////////////////////////////////////////////
+   // parallel command (built-in), see parallel_builtin()
+   /////////////////////////////////////////////////////////////////////////
+   else if (strcmp(command, "parallel") == 0) {
+      childExitMethod = parallel_builtin(&cmd_arena, args, num_args, pipeline->redirects);
+      result = exit_code(childExitMethod);
+   }
+
+   /////////////////////////////////////////////////////////////////////////
+   // jobs, fg, bg & wait (built-in), see job control
+   /////////////////////////////////////////////////////////////////////////
+   else if (strcmp(command, "jobs") == 0) {
+      result = jobs_builtin(args, num_args);
+   }
+   else if (strcmp(command, "fg") == 0) {
+      result = fg_builtin(args, num_args);
+   }
+   else if (strcmp(command, "bg") == 0) {
+      result = bg_builtin(args, num_args);
+   }
+   else if (strcmp(command, "wait") == 0) {
+      result = wait_builtin(args, num_args);
+   }
+
+   /////////////////////////////////////////////////////////////////////////
+   // echo, true, false, test, [ & printf (built-in), see run_utility()
+   /////////////////////////////////////////////////////////////////////////
+   else if ((utility = find_utility(command)) != NULL) {
+      usage_clear(&fg_usage); // no process, nothing to account for
+      result = run_utility(utility, pipeline);
+      childExitMethod = W_EXITCODE(result, 0);
+   }
+
+   /////////////////////////////////////////////////////////////////////////
+   // non-built in commands
+   /////////////////////////////////////////////////////////////////////////
+   // passed on to a member of the exec() family of functions
+   /////////////////////////////////////////////////////////////////////////
+   else {
+      fflush(stdout); // children write straight to fd 1, keep the order
+      pids = arena_alloc(&cmd_arena, num_stages * sizeof(pid_t));
+      if (!spawn_wait(num_stages)) { // handle forkbombs, see spawn limits
+         result = 128 + SIGINT;
+      }
+      else if (run_in_background == 0) { // if run in foreground...
+         ran_fg = 1;
+         launch_pipeline(pipeline, 0, pids);
+         // in the job table too, in case it gets stopped (a last stage
+         // that couldn't start counts as exit value 1)
+         job = job_add(pids, num_stages, p->text);
+         result = foreground_job(job, 0);
+      }
+      else { // run in background...
+         // JOBS_MAX caps how many bgr jobs run at once, wait for a slot;
+         // only a running one can free it up, a stopped one never will
+         jobs_max_env = getenv("JOBS_MAX");
+         jobs_max = jobs_max_env != NULL ? atoi(jobs_max_env) : 0;
+         while (jobs_max > 0 && num_jobs >= jobs_max && children_running() > 0
+                && !caught_sigint) {
+            struct pollfd pipe_fd = { signal_pipe[0], POLLIN, 0 };
+            poll(&pipe_fd, 1, -1); // a SIGCHLD (or a ctrl-c) comes in
+            reap_children(0);
+         }
+         if (jobs_max > 0 && num_jobs >= jobs_max) {
+            if (!caught_sigint) {
+               fprintf(stderr, "too many jobs (JOBS_MAX is %d), none of them running\n",
+                       jobs_max);
+            }
+            result = 1;
+         }
+         else if (launch_pipeline(pipeline, 1, pids) > 0) {
+            // shell will not wait for background commands to complete,
+            // the job table remembers it until reap_children() sees it end
+            job = job_add(pids, num_stages, p->text);
+            last_bg_pid = pids[num_stages - 1] != -1 ? pids[num_stages - 1] : job->pgid;
+            // shell will print pid of bgr process when it begins
+            printf("background pid is %d\n", job->pgid);
+         }
+         else {
+            result = 1;
+         }
+      }
+   }
+
+   if (pids == NULL && num_args > 0) { // it was a built-in
+      TRACE_END(builtin_start, TRACE_BUILTIN, 0);
+   }
+
+   // time prefix: the shell's own cpu time plus the foreground command's
+   if (p->timed) {
+      getrusage(RUSAGE_SELF, &self_end);
+      timersub(&self_end.ru_utime, &self_start.ru_utime, &self_end.ru_utime);
+      timersub(&self_end.ru_stime, &self_start.ru_stime, &self_end.ru_stime);
+      if (ran_fg) {
+         rusage_add(&self_end, &fg_usage.ru);
+      }
+      print_time(secs_since(&time_start), &self_end);
+   }
+
+   arena_restore(&cmd_arena, mark);
+   return result;
+}
+
+int run_list(struct node *n);
+
+// ( list ): run it in a forked copy of the shell, as a job of its own
+int run_subshell(struct node *n) {
+   int background = n->background && fg_only_mode == 0;
+   pid_t pgid = background || job_control ? 0 : -1; // like launch_pipeline()
+   struct job *job;
+   pid_t pid;
+
+   if (!spawn_wait(1)) {
+      return 128 + SIGINT;
+   }
+   fflush(stdout); // or the child prints it again
+   pid = fork();
+   if (pid == -1) {
+      perror("fork");
+      return 1;
+   }
+   if (pid == 0) { // in child: a shell of its own, without job control
+      if (pgid != -1) {
+         setpgid(0, 0);
+      }
+      if (job_control && !background) { // SIGTTOU is still ignored here
+         tcsetpgrp(STDIN_FILENO, getpid());
+      }
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTSTP, SIG_DFL);
+      signal(SIGTTIN, SIG_DFL);
+      signal(SIGTTOU, SIG_DFL);
+      signal(SIGPIPE, SIG_DFL);
+      job_control = 0;
+      state_file = NULL; // only the real shell saves its state
+      while (job_live != -1) { // the parent's jobs aren't ours to wait for
+         job_remove(&jobs[job_live]);
+      }
+      notices.len = notices.done = notices.failed = 0; // nor to report
+      // a signal pipe of its own, so we don't eat the parent's wakeups
+      close(signal_pipe[0]);
+      close(signal_pipe[1]);
+      if (signal_pipe_open() == -1) {
+         perror("pipe2");
+         _exit(1);
+      }
+      if (background) { // bgr commands default to /dev/null
+         dup2(devnull_fd, 0);
+         dup2(devnull_fd, 1);
+      }
+      exit(run_list(n->body));
+   }
+   if (pgid != -1) { // both sides setpgid, no race
+      setpgid(pid, pid);
+   }
+   job = job_add(&pid, 1, n->text);
+   if (background) {
+      last_bg_pid = pid;
+      printf("background pid is %d\n", pid);
+      return 0;
+   }
+   if (job_control) {
+      tcsetpgrp(STDIN_FILENO, pid);
+   }
+   return foreground_job(job, 0);
+}
+
+int run_node(struct node *n) {
+   struct arena_mark mark;
+   struct command *items;
+   int result = 0;
+   int i;
+
+   switch (n->type) {
+   case NODE_FOR:
+      // the words are expanded once, before the first time round
+      mark = arena_save(&cmd_arena);
+      items = command_new(&cmd_arena);
+      for (struct word *w = n->items; w != NULL; w = w->next) {
+         expand_fields(&cmd_arena, w, items);
+      }
+      for (i = 0; i < items->num_args && !caught_sigint; i++) {
+         var_set(n->var, items->args[i]);
+         result = run_list(n->body);
+      }
+      arena_restore(&cmd_arena, mark);
+      return result;
+   case NODE_WHILE:
+      while (run_list(n->cond) == 0 && !caught_sigint) {
+         result = run_list(n->body);
+      }
+      return result;
+   case NODE_IF:
+      if (run_list(n->cond) == 0) {
+         return run_list(n->body);
+      }
+      return run_list(n->else_part);
+   case NODE_AND:
+   case NODE_OR: // the right side runs if the left one's status says so
+      result = run_list(n->cond);
+      if ((result == 0) == (n->type == NODE_AND) && !caught_sigint) {
+         result = run_list(n->body);
+      }
+      return result;
+   case NODE_SUBSHELL:
+      return run_subshell(n);
+   default:
+      return run_pipeline(n->pipe);
+   }
+}
+
+// run the commands of a list, one after the other; ctrl-c stops it
+int run_list(struct node *n) {
+   int result = 0;
+   for (; n != NULL && !caught_sigint; n = n->next) {
+      result = last_status = run_node(n);
+      // clean up zombies...
+      reap_children(0);
+   }
+   return result;
+}
+
+// Run a command line the parser's been through, as read by the shell
+// loop, and drop the caches that only last a line. Returns its $?, 2 for
+// a syntax error.
+int run_parsed(struct parse_entry *parsed) {
+   int result = 2;
+
+   caught_sigint = 0;
+   if (parsed->error != NULL) {
+      printf("syntax error: %s\n", parsed->error);
+      last_status = result; // so $? (and a script's exit status) says so
+   }
+   else {
+      result = run_list(parsed->tree);
+   }
+   append_cache_clear(); // don't hold >> files open at the prompt
+   glob_cache_clear(); // nor directory listings that could go stale
+
+   // clean up zombies...
+   reap_children(0);
+   return result;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+// command server
+/////////////////////////////////////////////////////////////////////////
+// smallsh --server /path.sock keeps one shell running and takes command
+// lines over a Unix socket, so a caller with lots of small tasks pays for
+// starting a shell (and warming its path & parse caches) just once.
+// Connections are served one at a time, in the order they come in, and
+// each can send any number of requests. A request is
+//
+//    uint32_t len      plus SCM_RIGHTS: the caller's stdin, stdout, stderr
+//    char text[len]    the command line(s), no '\0'
+//
+// The server puts the three fds in place of its own 0, 1 & 2, runs the
+// text like a -c string, puts its own back, and answers with
+//
+//    uint32_t status   $? of the text, 2 for a syntax error
+//
+// so output goes straight from the commands to wherever the caller points
+// it, never through the socket. Both ints are in host byte order, it's a
+// local socket. Everything else carries over from one request to the
+// next like from line to line of a script: cwd, variables, bgr jobs, the
+// caches. `exit` stops the server: its request still gets an answer,
+// and the socket file is removed on the way out (on SIGTERM or SIGHUP
+// too).
+//
+// smallsh --client /path.sock 'commands' ... is the other end: it sends
+// each argument as a request, with its own 0, 1 & 2, and exits with the
+// status of the last one.
+/////////////////////////////////////////////////////////////////////////
+#define SERVER_MAX_REQUEST (16 << 20) // bytes of text, anything bigger is refused
+
+// fill addr in for path, 0 if it doesn't fit
+int socket_addr(struct sockaddr_un *addr, const char *path) {
+   memset(addr, 0, sizeof(*addr));
+   addr->sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof(addr->sun_path)) {
+      fprintf(stderr, "%s: socket path too long\n", path);
+      return 0;
+   }
+   strcpy(addr->sun_path, path);
+   return 1;
+}
+
+// all of len bytes, or 0 at end of file or on an error
+int read_full(int fd, void *buf, size_t len) {
+   while (len > 0) {
+      ssize_t n = read(fd, buf, len);
+      if (n == -1 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return 0;
+      }
+      buf = (char *)buf + n;
+      len -= n;
+   }
+   return 1;
+}
+
+// send all of len bytes, 0 if the other end is gone
+int send_full(int sock, const void *buf, size_t len) {
+   while (len > 0) {
+      ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+      if (n == -1 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return 0;
+      }
+      buf = (const char *)buf + n;
+      len -= n;
+   }
+   return 1;
+}
+
+// sleep until fd can be read, reaping (and reporting) bgr jobs meanwhile
+void server_wait(int fd) {
+   struct pollfd fds[2] = { { fd, POLLIN, 0 }, { signal_pipe[0], POLLIN, 0 } };
+   for (;;) {
+      if (poll(fds, 2, -1) == -1) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return; // let the accept()/recvmsg() block instead
+      }
+      if (fds[1].revents != 0) {
+         reap_children(0);
+         notices_flush(NULL);
+      }
+      if (fds[0].revents != 0) {
+         return;
+      }
+   }
+}
+
+// The next request on conn: its text (malloc'd), and the caller's 0, 1
+// & 2 in fds. NULL once the caller hangs up, or if it breaks protocol.
+char *server_recv(int conn, int fds[3]) {
+   union { // aligned for a cmsghdr
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(3 * sizeof(int))];
+   } control;
+   uint32_t len;
+   struct iovec iov = { &len, sizeof(len) };
+   struct msghdr msg;
+   struct cmsghdr *c;
+   int num_fds = 0;
+   char *text = NULL;
+   ssize_t n;
+
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control.buf;
+   msg.msg_controllen = sizeof(control.buf);
+   server_wait(conn);
+   do {
+      n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+   } while (n == -1 && errno == EINTR);
+   for (c = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL; c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+         continue;
+      }
+      int *got = (int *)CMSG_DATA(c);
+      for (size_t i = 0; i < (c->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+         if (num_fds < 3 && (got[i] = high_fd(got[i])) != -1) {
+            fds[num_fds++] = got[i];
+         }
+         else if (got[i] != -1) {
+            close(got[i]);
+         }
+      }
+   }
+   // the rest of a header that came in pieces, then the text
+   if (n > 0 && num_fds == 3 && !(msg.msg_flags & MSG_CTRUNC)
+       && read_full(conn, (char *)&len + n, sizeof(len) - n)
+       && len <= SERVER_MAX_REQUEST && (text = malloc(len + 1)) != NULL) {
+      if (read_full(conn, text, len)) {
+         text[len] = '\0';
+         return text;
+      }
+      free(text);
+   }
+   while (num_fds > 0) {
+      close(fds[--num_fds]);
+   }
+   return NULL;
+}
+
+pid_t server_pid = -1; // the server itself, not a child it forked
+const char *server_sock_path = NULL;
+int server_conn = -1; // the connection whose request is running
+
+// exit() while serving: answer the request that ran exit, and take the
+// socket file away
+static void server_on_exit(int status, void *arg) {
+   uint32_t answer = status;
+   if (getpid() != server_pid) {
+      return;
+   }
+   if (server_conn != -1) {
+      fflush(stdout); // before the caller hears we're done
+      send_full(server_conn, &answer, sizeof(answer));
+      close(server_conn);
+   }
+   unlink(server_sock_path);
+}
+
+// killed: take the socket file away, then die of sig after all
+static void server_catch(int sig) {
+   if (getpid() == server_pid) {
+      unlink(server_sock_path);
+   }
+   raise(sig); // SA_RESETHAND put the default action back
+}
+
+// run text with the caller's fds as 0, 1 & 2, then go back to the
+// server's own (saved). Returns its $?.
+uint32_t server_request(const char *text, int fds[3], const int saved[3]) {
+   int status;
+
+   fflush(stdout);
+   for (int i = 0; i < 3; i++) {
+      dup2(fds[i], i);
+      close(fds[i]);
+   }
+   arena_reset(&cmd_arena);
+   status = run_parsed(parse_cached(text));
+   notices_flush(NULL); // goes to the caller too
+   for (int i = 0; i < 3; i++) {
+      dup2(saved[i], i);
+   }
+   clearerr(stdout); // the caller's end may have been closed on us
+   return status;
+}
+
+// --server: serve requests on path until someone runs exit
+void server_run(const char *path) {
+   struct sockaddr_un addr;
+   struct stat st;
+   int saved[3]; // the server's own 0, 1 & 2
+   int fds[3];
+   char *text;
+   int sock, conn;
+
+   if (!socket_addr(&addr, path)) {
+      exit(1);
+   }
+   // a socket left over from a server that's gone, never anything else
+   if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+      unlink(path);
+   }
+   sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (sock != -1) {
+      sock = high_fd(sock); // out of the way of the requests' redirections
+   }
+   if (sock == -1 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+      perror(path);
+      exit(1);
+   }
+   // from here on, however the server ends, the socket file goes with it
+   server_pid = getpid();
+   server_sock_path = path;
+   on_exit(server_on_exit, NULL);
+   struct sigaction term_action = { 0 };
+   term_action.sa_handler = server_catch;
+   term_action.sa_flags = SA_RESETHAND;
+   sigemptyset(&term_action.sa_mask);
+   sigaction(SIGTERM, &term_action, NULL);
+   sigaction(SIGHUP, &term_action, NULL);
+   if (listen(sock, 64) == -1) {
+      perror(path);
+      exit(1);
+   }
+   for (int i = 0; i < 3; i++) {
+      if ((saved[i] = fcntl(i, F_DUPFD_CLOEXEC, REDIRECT_FD_MAX + 1)) == -1) {
+         saved[i] = devnull_fd; // started with it closed
+      }
    }
-   else { // if already in fg only mode, switch to non-fg only mode
-      fg_only_mode = 0;
-      write(STDOUT_FILENO, exit_fg_mode, 29);
+   // a caller that goes away mid-request mustn't take the server with it;
+   // children get SIGPIPE back, see launching
+   signal(SIGPIPE, SIG_IGN);
+
+   for (;;) {
+      server_wait(sock);
+      conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+      if (conn != -1) {
+         conn = high_fd(conn);
+      }
+      if (conn == -1) {
+         if (errno != EINTR && errno != ECONNABORTED) {
+            perror("accept");
+         }
+         continue;
+      }
+      server_conn = conn; // for an exit in the middle of it
+      while ((text = server_recv(conn, fds)) != NULL) {
+         uint32_t status = server_request(text, fds, saved);
+         free(text);
+         if (!send_full(conn, &status, sizeof(status))) {
+            break;
+         }
+      }
+      server_conn = -1;
+      close(conn);
+   }
+}
+
+// --client: send each of lines to the server at path along with our own
+// 0, 1 & 2 to run them with. Returns the last one's status.
+int client_run(const char *path, char **lines, int num_lines) {
+   struct sockaddr_un addr;
+   union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(3 * sizeof(int))];
+   } control;
+   int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+   uint32_t status = 0;
+   int sock;
+
+   if (!socket_addr(&addr, path)) {
+      return 1;
+   }
+   sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+      perror(path);
+      return 1;
+   }
+   for (int i = 0; i < num_lines; i++) {
+      uint32_t len = strlen(lines[i]);
+      struct iovec iov = { &len, sizeof(len) };
+      struct msghdr msg;
+      struct cmsghdr *c;
+      ssize_t n;
+
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof(control.buf);
+      c = CMSG_FIRSTHDR(&msg);
+      c->cmsg_level = SOL_SOCKET;
+      c->cmsg_type = SCM_RIGHTS;
+      c->cmsg_len = CMSG_LEN(sizeof(fds));
+      memcpy(CMSG_DATA(c), fds, sizeof(fds));
+      do {
+         n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+      } while (n == -1 && errno == EINTR);
+      if (n != sizeof(len) || !send_full(sock, lines[i], len)
+          || !read_full(sock, &status, sizeof(status))) {
+         fprintf(stderr, "%s: no answer from the server\n", path);
+         return 1;
+      }
    }
+   close(sock);
+   return status;
 }
 
-int main() {
-   const int argsize = 20;
+/////////////////////////////////////////////////////////////////////////
+// Usage:
+//    smallsh                 interactive (prompts if stdin is a terminal)
+//    smallsh script [args]   run the commands in script ($0 is script,
+//                            $1 ... the args)
+//    smallsh -c 'commands' [name [args]]   run the given command line(s),
+//                            with $0 set to name and $1 ... to the args
+//    smallsh --server path   run command lines sent over a Unix socket
+//    smallsh --client path 'commands' ...   send them to such a server
+/////////////////////////////////////////////////////////////////////////
+int main(int argc, char *argv[]) {
 
    // loops
-   int i = 0;
    int j = 0;
 
-   // flags
-   int shell_exit = 0; // determines whether user input == exit
-   int run_in_background = 0; // keeps track of whether its a bgr process
-
    // holding user input
-   char *user_input = malloc(2048 * sizeof(char)); // can support 2048 chars
-   char *input = malloc(2048 * sizeof(char)); // can support 2048 chars
-
-   // for parsing user input into arg array
-   int num_args = 0; // keep track of # of args
-   char *token = malloc(argsize * sizeof(char)); // for strtok
-   char *command = malloc(argsize * sizeof(char)); // store the command
-
-   // hold input file and output file
-   char *input_file = malloc(25 * sizeof(char));
-   char *output_file = malloc(25 * sizeof(char));
-   int input_fd; // input file descriptor...look @ slide 130
-   int output_fd; // output file descriptor
-   int result = 0; // store dup2 errors
+   struct reader input; // where command lines come from
+   int interactive = 0; // prompt only if a person is typing at us
+   char *user_input = NULL; // current line, as read
+   char *more = NULL; // lines of a for/while/if read so far, plus the next
+   size_t more_cap = 0;
+
+   const char *server_path = NULL; // --server, see command server
+
+   if (argc >= 3 && strcmp(argv[1], "--client") == 0) {
+      return client_run(argv[2], argv + 3, argc - 3);
+   }
+   script_args = argv; // $0 is the shell, unless...
+   num_script_args = 1;
+   if (argc >= 3 && strcmp(argv[1], "-c") == 0) {
+      reader_init_string(&input, argv[2]);
+      if (argc >= 4) {
+         script_args = argv + 3;
+         num_script_args = argc - 3;
+      }
+   }
+   else if (argc >= 3 && strcmp(argv[1], "--server") == 0) {
+      server_path = argv[2];
+      reader_init_string(&input, ""); // requests come in over the socket
+   }
+   else if (argc >= 2) {
+      int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+      if (fd == -1 || (fd = high_fd(fd)) == -1) { perror(argv[1]); exit(1); }
+      reader_init_fd(&input, fd);
+      script_args = argv + 1;
+      num_script_args = argc - 1;
+   }
+   else {
+      reader_init_fd(&input, STDIN_FILENO);
+      interactive = isatty(STDIN_FILENO);
+   }
+
+   arena_init(&cmd_arena, 8192);
+   usage_clear(&fg_usage);
+   devnull_open();
+   shell_pid = getpid();
+   notify_mode_init(getenv("SMALLSH_NOTIFY"));
+   spawn_limits_init();
+
+   // pick up where the last shell left off, see state snapshot
+   if (getenv("SMALLSH_STATE") != NULL && *getenv("SMALLSH_STATE") != '\0') {
+      state_file = strdup(getenv("SMALLSH_STATE"));
+      state_load(state_file);
+   }
+
+   // remember what's typed, see history
+   if (interactive) {
+      const char *path = getenv("SMALLSH_HISTORY");
+      char *home_path = NULL;
+      if (path == NULL && getenv("HOME") != NULL) {
+         home_path = malloc(strlen(getenv("HOME")) + sizeof("/.smallsh_history"));
+         if (home_path == NULL) { perror("malloc"); exit(1); }
+         sprintf(home_path, "%s/.smallsh_history", getenv("HOME"));
+         path = home_path;
+      }
+      if (path != NULL && *path != '\0') {
+         history_open(path);
+      }
+      free(home_path);
+   }
+
+   // for parsing user input
+   struct parse_entry *parsed; // syntax tree for the line, from the cache
    char *cwd = malloc(75 * sizeof(char)); // for getting cwd for debug
    char buff[76]; // for cwd for debug
 
-   // processes and children
-   pid_t spawnpid = getpid(); //holds process id
-   int childExitMethod = -5;
-   int exit_status = 0; // holds the exit status if one exists
-   int term_signal = 0; // holds the term signal if one exists
-   int fork_now = 0; // flag to avoid fork bombs
-   // allocate space for 150(?) child process ids
-   pid_t *children = malloc(150 * sizeof(pid_t));
-   int num_procs = 0; // holds the total # processes for array indexing
-
 
    ///////////////////////////////////////////////////////////////////////////
    // signal handling
    ///////////////////////////////////////////////////////////////////////////
    // CTRL-C command will send SIGINT signal
    // Make sure SIGINT only terminates foreground command, if one is running. 
-   // Because of re-entrancy, do not use printf() in signal handling functions
+   // The handlers only poke the signal pipe, see signal handling; they're
+   // safe to run inside each other, so nothing needs blocking while they do
    ///////////////////////////////////////////////////////////////////////////
    struct sigaction SIGINT_action;
    struct sigaction SIGTSTP_action;
+   struct sigaction SIGCHLD_action;
+
+   if (signal_pipe_open() == -1) {
+      perror("pipe2");
+      exit(1);
+   }
 
    SIGINT_action.sa_handler = catchSIGINT;
-   sigfillset(&SIGINT_action.sa_mask);
+   sigemptyset(&SIGINT_action.sa_mask);
    SIGINT_action.sa_flags = SA_RESTART;
 
    SIGTSTP_action.sa_handler = catchSIGTSTP;
-   sigfillset(&SIGTSTP_action.sa_mask);
+   sigemptyset(&SIGTSTP_action.sa_mask);
    SIGTSTP_action.sa_flags = SA_RESTART;
 
+   SIGCHLD_action.sa_handler = catchSIGCHLD;
+   sigemptyset(&SIGCHLD_action.sa_mask);
+   SIGCHLD_action.sa_flags = SA_RESTART; // stops too, for the job table
+
    sigaction(SIGINT, &SIGINT_action, NULL);
    sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+   sigaction(SIGCHLD, &SIGCHLD_action, NULL);
+
+   // job control: wait until we're in the foreground, then take over the
+   // terminal with a process group of our own. SIGTTOU is ignored so the
+   // shell can hand the terminal back and forth from either side.
+   if (interactive) {
+      while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) {
+         kill(-shell_pgid, SIGTTIN);
+      }
+      signal(SIGTTIN, SIG_IGN);
+      signal(SIGTTOU, SIG_IGN);
+      if (getpid() != shell_pgid && setpgid(0, 0) == -1) {
+         perror("setpgid");
+      }
+      shell_pgid = getpgrp();
+      if (tcsetpgrp(STDIN_FILENO, shell_pgid) == 0
+          && tcgetattr(STDIN_FILENO, &shell_tmodes) == 0) {
+         job_control = 1;
+      }
+   }
+
+   if (server_path != NULL) {
+      server_run(server_path); // never comes back
+   }
 
    ////////////////////////////////////////////////////////////////////////////
    //                             shell loop
@@ -115,330 +6291,78 @@ int main() {
    //////////////////////////////////////////////////////////////////////////// 
    do {
       //*********reset these vars for safety****************
-      fflush(stdout);
-      num_args = 0;
-      run_in_background = 0;
-      fork_now = 0;
-      memset(command, '\0', sizeof(command));
-      memset(user_input, '\0', sizeof(input));
-      memset(input_file, '\0', sizeof(input_file));
-      memset(output_file, '\0', sizeof(output_file));
-      char *args[513];
-      for (i = 0; i < 513; i++) { // 512 args + 1 command
-         args[i] = malloc(20 * sizeof(char));
-         memset(args[i], '\0', sizeof(args[i]));
-      }
+      arena_reset(&cmd_arena); // drop everything from the last command
 
       /////////////////////////////////////////////////////////////////////////
       // The Prompt
       /////////////////////////////////////////////////////////////////////////
       // Syntax of command line:
-      //    command [arg1 arg2 ...] [< input_file] [> output_file] [&]
-      // where the items in brackets [] are optional. 
+      //    command [arg1 arg2 ...] [< input_file] [> output_file] [2>&1 ...] [| command ...] [&]
+      // where the items in brackets [] are optional; several of them can
+      // go on one line split by ; (or &), along with for, while & if.
       // 
-      // Uses a colon (:) as a prompt for each command line.
+      // Uses a colon (:) as a prompt for each command line, as long as stdin
+      // is a terminal; scripts, -c and piped input run without one. The
+      // lines after the first of an unfinished for/while/if get a > prompt.
       //
       // Handling blank lines and comments:
       //  - When we receive a blank line or a line beginning with the 
       //  '#' character, do nothing, and re-prompt.
       /////////////////////////////////////////////////////////////////////////
-      printf(": ");
-      fflush(stdout); // flush buffers every time for safety/sanity!
-      char *r;
-      r = fgets(user_input, 2049, stdin); // read at most 2048 chars
-
-
-      /////////////////////////////////////////////////////////////////////////
-      // PARSE USER INPUT
-      /////////////////////////////////////////////////////////////////////////
-      // Format: 
-      //    command [arg1 arg2...] [< input_file] {> output_file] [&]
-      // store command into 'command' var
-      // store args into arg array
-      // store input file into 'input_file' var
-      // store output file into 'output_file' var
-      // flag the & with 'run_in_background' var
-      // store the total # of args in num_args
-      ////////////////////////////////////////////////////////////////////////
-      if (user_input[0] == '\n') { // check for blank line
-         token = NULL; // if blank, no need to tokenize
-      }
-      else { // a-ok to tokenize...get command or comment
-         token = strtok(user_input, " \n"); // get command or comment
-         if (token[0] == '#') { // check whether line is a comment
-            token = NULL; // if line is a comment, skip the following loop.
-         }
-         else { // if not a comment, it's a command
-            strcpy(command, token);
-         }
-      }
-
-      // tokenize the rest of the command line input...
-      while (token != NULL) {
-         if (strcmp(token, "<") == 0) { // is there an input file?
-            // [< input file] : we know the next "arg" is input file
-            token = strtok(NULL, " \n"); // get the input file
-            strcpy(input_file, token); // store input_file
-         }
-         else if (strcmp(token, ">") == 0) { // is there an output file?
-            // [ > output file] : we know the next "arg" is the output file
-            token = strtok(NULL, " \n"); // get the output file
-            strcpy(output_file, token); // store output_file
-         }
-         else if (strcmp(token, "&") == 0) {// should this be run in the bgr?
-            // don't run it in the bgr if the command is echo or if fg only mode
-            if (fg_only_mode == 0 && (strcmp(command, "echo") != 0)) {
-               run_in_background = 1; // set flag only if conditions met
-            }
-         }
-         else { // everything else is considered an argument!
-           // if it were the first time thru the loop, the 1st token (command)
-           // would go into the args array, but the command isn't an arg.
-           // still need to keep the cmnd in here for execv() though
-            strcpy(args[num_args], token);      
-            num_args++;
-         }
-         token = strtok(NULL, " \n"); // get next token
-      }
-      // last arg must be NULL for execvp()!!!!!!!
-      args[num_args] = NULL;
-
-      // replace any instance of $$ with pid
-      char *tmpstr = malloc(20*sizeof(char));
-      for (i = 0; i < num_args; i++) {
-         if (strstr(args[i], "$$")!=NULL) { // found substring
-            // if arg is simply $$, not appended to anything
-            if (strcmp(args[i], "$$") == 0) {
-               sprintf(args[i], "%d", getpid());
-            }
-            // if its appended to something else
-            else { // note: this only works if $$ is appended to the end
-               tmpstr = strtok(args[i], "$$");
-               sprintf(args[i], "%s%d", tmpstr, getpid());
-            }
+      input.prompt = interactive ? ": " : NULL;
+      notices_flush(input.prompt); // along with anything bgr jobs had to say
+      TRACE_START(read_start);
+      user_input = reader_getline(&input);
+      TRACE_END(read_start, TRACE_READ, 0);
+      if (user_input == NULL) { // end of input, same as exit
+         if (state_file != NULL) {
+            state_save(state_file);
          }
+         kill_jobs();
+         exit(last_status); // $?, built-ins included
       }
 
 
       /////////////////////////////////////////////////////////////////////////
-      // exit command (built-in)
-      /////////////////////////////////////////////////////////////////////////
-      // When this command is run, shell kills any other processes or jobs that 
-      // the shell started before it terminates itself.
-      //
-      // Note: If the user tries to run a built in command in the background 
-      // with &, ignore it, and run it in the foreground.
+      // PARSE USER INPUT
       /////////////////////////////////////////////////////////////////////////
-      if (strcmp(command, "exit") == 0) {
-         // kill off any processes or commands before exiting...
-         // loop thru background processes & raise sigkill on each process:
-         for (i = 0; i < num_procs; i++) {
-            if (children[i] > 0) {
-               kill(SIGKILL, children[i]);
-               // wait for the dieing process
-               waitpid(children[i], &childExitMethod, 0);
-            }
-         }
-         shell_exit = 1;
-         exit(0);
+      // parse_cached() hands back the syntax tree (parsing the line only if
+      // it hasn't been seen lately). If it opens a for/while/if that isn't
+      // closed yet, or a here-doc whose body isn't all there, tack on the
+      // next line and try again.
+      ////////////////////////////////////////////////////////////////////////
+      if (hist.fd != -1 && user_input[0] == '!'
+          && (user_input = history_expand(user_input)) == NULL) {
+         continue; // nothing it could be, already said so
       }
-
-      /////////////////////////////////////////////////////////////////////////
-      // cd command (built-in)
-      /////////////////////////////////////////////////////////////////////////
-      // changes directories
-      //
-      // By itself (cd), it changes the directory specified in the HOME env.
-      // variable (NOT the location where smallsh was executed from, unless 
-      // smallsh is located in the HOME dir).
-      // 
-      // It can take 1 arg: the path of the directory to change to. 
-      //
-      // Note: Supports exact and relative paths.
-      //////////////////////////////////////////////////////////////////////////
-      else if (strcmp(command, "cd") == 0) {
-         if (num_args == 1) { // an arg was not specified
-            // change location to dir specified in the HOME environment variable
-            chdir((getenv("HOME")));
+      parsed = parse_cached(user_input);
+      while (parsed->incomplete) {
+         input.prompt = interactive ? "> " : NULL;
+         notices_flush(input.prompt);
+         user_input = reader_getline(&input);
+         if (user_input == NULL) {
+            break; // report it as a syntax error
          }
-         else if (num_args == 2){ // 1 arg was specified
-            // change location to arg[1]
-            chdir(args[1]);
+         size_t len = strlen(parsed->text);
+         size_t need = len + strlen(user_input) + 2;
+         if (need > more_cap) {
+            more_cap = need * 2;
+            more = realloc(more, more_cap);
+            if (more == NULL) { perror("realloc"); exit(1); }
          }
-         fflush(stdout);
+         memmove(more, parsed->text, len); // text may be more itself, on a hit
+         more[len] = '\n';
+         strcpy(more + len + 1, user_input);
+         parsed = parse_cached(more);
       }
+      history_add(parsed->text);
 
-      /////////////////////////////////////////////////////////////////////////
-      // status command (built-in)
-      /////////////////////////////////////////////////////////////////////////
-      // prints out either:
-      //   the exit status 
-      //        OR
-      //   the termianting signal of the last *foreground* process.
-      /////////////////////////////////////////////////////////////////////////
-      else if (strcmp(command, "status") == 0) {
-         if (WIFEXITED(childExitMethod) != 0) {
-            // terminated normally, get exit status
-            exit_status = WEXITSTATUS(childExitMethod);
-            printf("exit value %d\n", exit_status);
-            fflush(stdout);
-         } // if here, not exited normally
-         else if (WIFSIGNALED(childExitMethod) != 0) {
-           // the process was terminated by a signal
-           term_signal = WTERMSIG(childExitMethod);
-           printf("terminated by signal %d\n", term_signal);
-           fflush(stdout);
-         } 
-      }
 
       /////////////////////////////////////////////////////////////////////////
-      // non-built in commands
+      // RUN IT, see run_parsed()
       /////////////////////////////////////////////////////////////////////////
-      // passed on to a member of the exec() family of functions
-      /////////////////////////////////////////////////////////////////////////
-      else {
-         if (run_in_background == 0) { // if run in foreground...
-	    spawnpid = fork();
-            fork_now++;
-            if (fork_now >= 50) { // handle forkbomb errors
-               printf("over 50 forks...aborting...\n");
-               abort();
-            }
-            switch(spawnpid) {
-               case -1: 
-                  // ERROR
-                  perror("fork error\n");
-                  exit(1);
-                  break;
-               case 0:
-               // in child... 
-                  // redirect stdin if we have input file
-                  if (input_file[0] != '\0') { // an input file is specified
-                     input_fd = open(input_file, O_RDONLY);
-                     if (input_fd == -1) { perror("open()"); exit(1); }
-                     // call dup2() to change in_fd to point where stdin points
-                     result = dup2(input_fd, 0); // stdin == 0
-                     if (result == -1) { perror("dup2"); exit(2); }
-                  }
-                  // redirect stdout if we have output file
-                  if (output_file[0] != '\0') { // an output file is specified
-                     output_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                     if (output_fd == -1) { perror("open()"); exit(1); }
-                     // call dup2() to change out_fd to point where stdout points
-                     result = dup2(output_fd, 1); // stdout == 1
-                     if (result == -1) { perror("dup2"); exit(2); }
-                  }
-                  // call execvp
-                  if (execvp(args[0], args) < 0) {
-                     // if it returns, there was an error
-                     perror("incorrect command");
-                     exit(1);
-                  }
-                  break;
-               default:
-               // in parent...
-                  waitpid(spawnpid, &childExitMethod, 0);
-                  // if child killed by signal, print out signal #
-                  if (WIFEXITED(childExitMethod) != 0) {
-                     // terminated normally, get exit status
-                     exit_status = WEXITSTATUS(childExitMethod);
-                  } // if here, not exited normally
-                  else if (WIFSIGNALED(childExitMethod) != 0) {
-                     // the process was terminated by a signal
-                     term_signal = WTERMSIG(childExitMethod);
-                     if (term_signal != 11) {
-                        printf("terminated by signal %d\n", term_signal);
-                     }
-                  }
-                  break;
-            }
-         }
-         else { // run in background...
-            spawnpid = fork();
-            fork_now++;
-            if (fork_now >= 50) { // handle forkbomb errors
-               printf("error: forked over 50 processes. aborting...\n");
-               abort();
-            }
-            switch(spawnpid) {
-               case -1: 
-                  perror("fork error\n");
-                  exit(1);
-                  break;
-               case 0: // in child... 
-                  // redirect stdin if we have input file
-                  if (input_file[0] != '\0') { // an input file is specified
-                     input_fd = open(input_file, O_RDONLY);
-                     if (input_fd == -1) { perror("open()"); exit(1); }
-                     // call dup2() to change in_fd to point where stdin points
-                     result = dup2(input_fd, 0); // stdin == 0
-                     if (result == -1) { perror("dup2"); exit(2); } // slide 126
-                  }
-                  else { // no specified input file
-                     // if not specified, bgr commands redirect to /dev/null/
-                     input_fd = open("/dev/null", O_RDONLY);
-                     // call dup2() to change devnull to pt where stdin points
-                     result = dup2(input_fd, 0); // stdin == 0
-                  }
-                  // redirect stdout if we have output file
-                  if (output_file[0] != '\0') { // an output file is specified
-                     output_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                     if (output_fd == -1) { perror("open()"); exit(1); }
-                     // call dup2() to change out_fd to point where stdout points
-                     result = dup2(output_fd, 1); // stdout == 1
-                     if (result == -1) { perror("dup2"); exit(2); } // slide 126
-                  }
-                  else { // no specified output file
-                     output_fd = open("/dev/null", O_WRONLY | O_CREAT, 0744);
-                     // call dup2() to change devnull to pt where stdout points
-                     result = dup2(output_fd, 1); // stdout == 1
-                  }
-                  if(execvp(args[0], args) < 0) { // call execvp
-                     // if it returns,there was an error
-                     perror("incorrect command");
-                     exit(1);
-                  }
-                  break;
-               default: // in background parent...
-                  // shell will print pid of bgr process when it begins
-                  printf("background pid is %d\n", spawnpid);
-                  children[num_procs] = spawnpid;
-                  num_procs++;
-                  // shell will not wait for background commands to complete
-                  if (WIFEXITED(childExitMethod != 0)) {
-                     exit_status = WEXITSTATUS(childExitMethod);
-                  } // if here, not exited normally
-                  else if (WIFSIGNALED(childExitMethod) != 0) {
-                  // the process was terminated by a signal
-                     term_signal = WTERMSIG(childExitMethod);
-                     printf("terminated by signal %d\n", term_signal);
-                  }
-                  break;
-            }
-         }
-      }
-
-      // loop over arr of pids and waitpid with nohang to clean up zombies...
-      int temp = 0;
-      for (i = 0; i < num_procs; i++) {
-         if (children[i] != -5) { // if child is not the flag-set reset child...
-            temp = waitpid(children[i], &childExitMethod, WNOHANG);
-         }
-         // if the process was completed, display pid & exit value/sig if exited
-         if (temp == children[i]) {
-            printf("process %d completed\n", children[i]);
-            if (WIFEXITED(childExitMethod != 0)) {
-               exit_status = WEXITSTATUS(childExitMethod);
-               printf("exit value %d\n", exit_status);
-            } // if exited by signal instead
-            else if (WIFSIGNALED(childExitMethod) != 0) {
-               term_signal = WTERMSIG(childExitMethod);
-               printf("term sig was %d\n", term_signal);
-            }
-            children[i] = -5; // flag for resetting finished child
-         }
-      }
+      run_parsed(parsed);
 
-   } while (!shell_exit);
+   } while (1);
    return 0;
 }